@@ -8,8 +8,18 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <stdint.h>
+
+// Allocator hooks: define all four before including Map.h to route its
+// memory through your own allocator.
+#ifndef MAP_MALLOC
+#define MAP_MALLOC(n) malloc(n)
+#define MAP_CALLOC(c, n) calloc(c, n)
+#define MAP_REALLOC(p, n) realloc(p, n)
+#define MAP_FREE(p) free(p)
+#endif
 
-#define toss(t, n) ((t*) malloc((n) * sizeof(t)))
+#define toss(t, n) ((t*) mmalloc((n) * sizeof(t)))
 #define zero(a) (memset(&(a), 0, sizeof(a)))
 
 typedef int (*const Direction)(const void*, const void*);
@@ -57,6 +67,8 @@ typedef struct {
 } BrogueRoom;
 
 
+// Rows of a generated map are one w * h block starting at walling[0];
+// xmclose frees it.
 typedef struct
 {
     char** walling;
@@ -65,26 +77,94 @@ typedef struct
 }
 Map;
 
+typedef bool (*MapRowCallback)(const char* row, const int y, const int w, void* user);
+
+// Optional generator output describing what was built. Rooms are the
+// bounding rectangles in placement order; a door is an opening in a room's
+// outline; a corridor joins rooms a and b (-1 when an end is not in a room)
+// between the tiles it was carved from and to. The room graph is CSR: the
+// neighbours of room i are adjacency[adjacency_start[i]] up to
+// adjacency[adjacency_start[i + 1]]. Release with xminfo_free.
+typedef struct
+{
+    int x;
+    int y;
+}
+MapCoord;
+
+typedef struct
+{
+    int x;
+    int y;
+    int room;
+}
+MapDoor;
+
+typedef struct
+{
+    int a;
+    int b;
+    MapCoord from;
+    MapCoord to;
+}
+MapCorridor;
+
+typedef struct
+{
+    Rect* rooms;
+    int room_count;
+    MapDoor* doors;
+    int door_count;
+    MapCorridor* corridors;
+    int corridor_count;
+    int* adjacency_start;
+    int* adjacency;
+}
+MapInfo;
+
+// Maze as a cell graph: 2 bits per cell (east and south passage).
+typedef struct
+{
+    unsigned char* bits;
+    int w;
+    int h;
+}
+MazeGraph;
+
 
 Map xmgen(const int w, const int h, const int grid, const int max);
-Map xmgen_graph(const int w, const int h, const int num_rooms, const int min_size, const int max_size, const int extra_connections);
+Map xmgen_graph(const int w, const int h, const int num_rooms, const int min_size, const int max_size, const int extra_connections, MapInfo* info);
 
 
-Map xmgen_scatter(int w, int h, int room_count, int min_sz, int max_sz);
+Map xmgen_scatter(int w, int h, int room_count, int min_sz, int max_sz, MapInfo* info);
 
 Map xmgen_drunk(const int w, const int h, float floor_goal_percent);
 
 Map xmgen_cellular(const int w, const int h, const float wall_percent, const int iterations);
 
-Map xmgen_brogue(const int w, const int h, const int max_rooms, const int min_size, const int max_size);
+Map xmgen_brogue(const int w, const int h, const int max_rooms, const int min_size, const int max_size, MapInfo* info);
 
-Map xmgen_bsp(const int w, const int h, const int min_room_size);
+Map xmgen_bsp(const int w, const int h, const int min_room_size, MapInfo* info);
 
 Map xmgen_perlin(const int w, const int h, const float threshold);
 
 Map xmgen_maze(const int wR, const int hR, const int w, const int h);
 
-Map xmgen_room_maze(const int wR, const int hR, const int w, const int h, const int num_rooms_to_try, const int min_room_size, const int max_room_size);
+// Streams a perfect maze row by row (Eller's algorithm) using O(w) memory.
+// emit receives each tile row and returns false to stop; rows <= 0 streams
+// until it does. Returns the number of tile rows emitted.
+int xmgen_maze_stream(const int w, const int rows, MapRowCallback emit, void* user);
+
+MazeGraph xmmaze_new(const int w, const int h);
+void xmmaze_carve(const MazeGraph maze);
+void xmmaze_braid(const MazeGraph maze, const float chance);
+void xmmaze_prune(const MazeGraph maze, const int passes);
+// Expands a window of cells into tiles at the map origin.
+void xmmaze_blit(const MazeGraph maze, const Map map, const int cx, const int cy, const int cw, const int ch);
+Map xmmaze_expand(const MazeGraph maze);
+void xmmaze_free(const MazeGraph maze);
+
+Map xmgen_room_maze(const int wR, const int hR, const int w, const int h, const int num_rooms_to_try, const int min_room_size, const int max_room_size, MapInfo* info);
 
 Map xmgen_subtractive(const int w, const int h, const int carve_count);
 
@@ -100,17 +180,423 @@ Map xmgen_rings(const int w, const int h, const int num_rings, const int ring_sp
 
 //bUNCH OF PREFABS is defined so change prefabs 
 //Tbd some interface maybe
-Map xmgen_prefab_rooms(const int w, const int h, const int num_rooms, const int min_dist);
+Map xmgen_prefab_rooms(const int w, const int h, const int num_rooms, const int min_dist, MapInfo* info);
 
 
 void xmgen_add_lake(Map* map, char tile, int x, int y,  int w, int h, float lakePercent);
 void xmgen_add_enviroment(Map* map, char tile, int x, int y,  int w, int h, float lakePercent);
 
+// Connectivity repair in O(w * h). MAP_CONNECT_JOIN carves '+' corridors
+// through interior walls until every floor component is reachable;
+// MAP_CONNECT_DROP_SMALL fills all but the largest component with '#'.
+// Returns the number of components found before the repair.
+#define MAP_CONNECT_JOIN 0
+#define MAP_CONNECT_DROP_SMALL 1
+
+int xmconnect(Map* map, const int mode);
+
+
+// Distance fields. xmdistance runs one multi-source BFS from the tile
+// indices in sources (y * w + x) and writes w * h distances to out; frontier
+// is caller scratch for w * h ints, so nothing is allocated. passable lists
+// the walkable tile chars (NULL: everything but '#'). With
+// MAP_DISTANCE_CHAMFER moves are 8-connected, costing 2 orthogonally and 3
+// diagonally, and diagonals may not cut wall corners.
+#define MAP_DISTANCE_CHAMFER 1
+#define MAP_DISTANCE_UNREACHABLE 0xFFFF
+#define MAP_DISTANCE_BLOCKED 0xFFFE
+#define MAP_DISTANCE_MAX 0xFFFD
+#define MAP_DISTANCE_CHAMFER_MAX 0x7FFD
+
+void xmdistance(const Map map, const int* sources, const int n, const char* passable, const int flags, unsigned short* out, int* frontier);
+
+// Jump Point Search. A MapPath holds the walkability bitmaps of one map plus
+// the per-query state, and is reused across queries. Tiles listed in blocked
+// are walls in addition to '#'. xmpath writes the tile indices (y * w + x)
+// of the path from start to end, both included, into path when max is big
+// enough and returns the path length in tiles, or -1 if there is no path.
+// Moves are 8-connected and diagonals may not cut wall corners.
+typedef struct
+{
+    uint64_t* rows;
+    uint64_t* cols;
+    int row_words;
+    int col_words;
+    int w;
+    int h;
+    int* g;
+    int* parent;
+    unsigned* stamp;
+    unsigned query;
+    uint64_t* heap;
+    int heap_count;
+    int heap_cap;
+}
+MapPath;
+
+MapPath xmpath_new(const Map map, const char* blocked);
+void xmpath_set(MapPath* p, const int x, const int y, const bool walkable);
+int xmpath(MapPath* p, const int sx, const int sy, const int ex, const int ey, int* path, const int max);
+void xmpath_free(MapPath* p);
+
+// Hierarchical A* on top of a MapPath. cluster is the cluster side in tiles
+// (<= 0 picks 16). xmhpa returns waypoints (y * w + x, start and end
+// included) instead of tiles; refine consecutive pairs with xmpath on
+// h.path, which is cheap since each hop is local. Use xmhpa_set instead of
+// xmpath_set so the touched cluster is rebuilt before the next query.
+typedef struct
+{
+    int* nodes;
+    int* twins;
+    int* dist;
+    int* east;
+    int* south;
+    int node_count;
+    int east_count;
+    int south_count;
+    int dirty;
+}
+MapCluster;
+
+typedef struct
+{
+    MapPath path;
+    MapCluster* clusters;
+    int size;
+    int cw;
+    int ch;
+    int node_cap;
+    int* node_at;
+    int* pool;
+    int* local;
+    unsigned char* grid;
+    int* bucket;
+    int* start_dist;
+    int* goal_dist;
+    bool dirty;
+}
+MapHpa;
+
+MapHpa xmhpa_new(const Map map, const char* blocked, int cluster);
+void xmhpa_set(MapHpa* h, const int x, const int y, const bool walkable);
+int xmhpa(MapHpa* h, const int sx, const int sy, const int ex, const int ey, int* waypoints, const int max);
+void xmhpa_free(MapHpa* h);
+
+// Field of view by recursive shadowcasting. A MapFov holds the opacity
+// bitmap ('#' plus the chars in opaque). xmfov clears visible, an array of
+// ((w + 63) / 64) * h words, and sets bit x of row y for each tile seen
+// from (x, y) within radius (<= 0 is unlimited); opaque tiles that bound
+// the view are included. xmfov_batch does the same for n viewers
+// (y * w + x) into consecutive bitmaps.
+typedef struct
+{
+    uint64_t* opaque;
+    int words;
+    int w;
+    int h;
+    int* span;
+    int radius;
+}
+MapFov;
+
+MapFov xmfov_new(const Map map, const char* opaque);
+void xmfov_set(MapFov* f, const int x, const int y, const bool opaque);
+void xmfov(MapFov* f, const int x, const int y, int radius, uint64_t* visible);
+void xmfov_batch(MapFov* f, const int* viewers, const int n, const int radius, uint64_t* visible);
+void xmfov_free(MapFov* f);
+
 
 void xmclose(const Map);
 
+void xminfo_free(MapInfo* info);
+
 void xmprint(const Map);
 
+// Writes the map to out a whole row per fwrite: plain text, text coloured
+// with 24-bit ANSI escapes in the demo's minimap palette, or a binary PPM
+// (that palette) or PGM (its luminance) image, one pixel per tile. Any
+// other format writes nothing and returns false.
+#define MAP_WRITE_ASCII 0
+#define MAP_WRITE_ANSI 1
+#define MAP_WRITE_PPM 2
+#define MAP_WRITE_PGM 3
+
+bool xmwrite(const Map map, FILE* out, const int format);
+
+// 64-bit FNV-1a over the size and every tile, row by row. Equal maps hash
+// equal whatever their storage, so it pins generator output for a seed.
+uint64_t xmhash(const Map);
+
+// Deltas for sending edits instead of whole maps. xmdiff encodes how b
+// differs from a (same size) as varint w and h, then per changed span the
+// varint count of unchanged tiles since the previous span (row-major), the
+// varint span length and the span's tiles from b. It returns the bytes
+// needed, 0 if the sizes differ, and fills buf only when they fit in cap;
+// w * h + 32 always does. Unchanged rows cost one memcmp. xmpatch applies
+// a delta to a map of a's size, leaving it untouched if the delta is
+// malformed or of another size.
+size_t xmdiff(const Map a, const Map b, unsigned char* buf, const size_t cap);
+bool xmpatch(const Map map, const unsigned char* buf, const size_t size);
+
+// Read-only run-length form for mostly-wall maps: per row, runs of one
+// tile, each stored as the x just past its end and the tile. row[y] ..
+// row[y + 1] index the runs of row y, so xmrle_at is a binary search over
+// one row. A run costs 3 bytes, so maps up to 65535 wide; xmrle returns a
+// zeroed MapRle (row NULL) for wider maps. Everything is one allocation;
+// free it with xmrle_free.
+typedef struct
+{
+    int w;
+    int h;
+    int count;  // runs
+    int* row;   // h + 1 run offsets
+    uint16_t* end; // per run
+    char* tile;    // per run
+}
+MapRle;
+
+MapRle xmrle(const Map map);
+Map xmrle_expand(const MapRle* rle);
+char xmrle_at(const MapRle* rle, const int x, const int y);
+void xmrle_row(const MapRle* rle, const int y, char* out);
+long xmrle_count(const MapRle* rle, const char tile);
+size_t xmrle_bytes(const MapRle* rle);
+void xmrle_free(MapRle* rle);
+
+#ifdef MAP_STATS
+// Work counters, compiled in only with MAP_STATS. xmstats copies what this
+// thread counted since its last call into stats (NULL just discards it)
+// and starts over, so bracket a generator call with two xmstats calls.
+typedef struct
+{
+    long mallocs;       // malloc, calloc and realloc calls
+    long frees;
+    long bytes;         // bytes requested
+    long rng_draws;
+    long cells_visited; // tiles read by CA passes, scans and floods
+    long rejected;      // placement attempts and probes that failed
+    long ca_iterations;
+    long floods;        // flood fill and BFS runs
+}
+MapStats;
+
+void xmstats(MapStats* stats);
+#endif
+
+#ifdef MAP_TRACE
+// Phase spans, compiled in only with MAP_TRACE. Each thread records into
+// its own ring of MAP_TRACE_EVENTS spans (oldest overwritten first).
+// xmtrace_write dumps every thread's ring as Chrome trace_event JSON for
+// Perfetto or chrome://tracing; call it while no generator is running.
+#ifndef MAP_TRACE_EVENTS
+#define MAP_TRACE_EVENTS 65536
+#endif
+
+bool xmtrace_write(FILE* out);
+void xmtrace_clear(void);
+#endif
+
+// Fixes the seed generators on this thread start from; without it they
+// seed from time(0). Also seeds the generators that never reseed.
+// Generators never touch rand(), and all their state is per thread.
+void xmseed(const unsigned seed);
+
+// Every generator by index or name, with its numeric parameters (names
+// space separated in params) and the values the demo uses as defaults.
+#define MAP_GENERATOR_PARAMS 4
+
+typedef struct
+{
+    const char* name;
+    const char* title;
+    const char* params;
+    float defaults[MAP_GENERATOR_PARAMS];
+    Map (*generate)(const int w, const int h, const float* params);
+}
+MapGenerator;
+
+extern const MapGenerator xmgenerators[];
+extern const int xmgenerator_count;
+const MapGenerator* xmgenerator_find(const char* name);
+
+// Runs a registry entry; params NULL means its defaults.
+Map xmgenerate(const MapGenerator* generator, const int w, const int h, const float* params);
+
+// Binary map files. xmsave writes a 64 byte header (size, generator name,
+// seed, xmhash checksum), the palette of tiles the map uses, then the rows
+// as raw bytes, palette indices bit-packed to 1, 2, 4 or 8 bits, or runs
+// of (index, varint length); MAP_SAVE_AUTO picks the smaller of the last
+// two, and any other encoding fails. xmload maps the file: raw rows are
+// used in place, copy-on-write, the other encodings are decoded. On
+// failure map.walling is NULL. Free with xmunload, not xmclose.
+#define MAP_SAVE_AUTO 0
+#define MAP_SAVE_RAW 1
+#define MAP_SAVE_PACKED 2
+#define MAP_SAVE_RLE 3
+
+typedef struct
+{
+    Map map;
+    char generator[24];
+    unsigned seed;
+    int encoding;
+    void* base;
+    size_t size;
+}
+MapFile;
+
+bool xmsave(const Map map, const char* path, int encoding, const char* generator, const unsigned seed);
+MapFile xmload(const char* path, const bool verify);
+void xmunload(MapFile* file);
+
+// A tile grid larger than memory, kept in a shared file mapping as 64x64
+// blocks (one 4 KiB page each) stored block row by block row, so the OS
+// only pages in the blocks being worked on. xmopen_mapped creates or
+// reopens path; tiles is NULL on failure or without mmap. Work on it a
+// chunk at a time: xmmapped_generate fills it with chunk x chunk maps
+// from a registry generator (seed + chunk index), xmmapped_blit and
+// xmmapped_read copy windows in and out of ordinary maps, and
+// xmmapped_noise / xmmapped_step are xmgen_cellular's noise and one CA
+// iteration, swept with a working set of one block row.
+#define MAP_BLOCK 64
+
+typedef struct
+{
+    char* tiles;
+    size_t size;
+    int w;
+    int h;
+    int bw;
+    int bh;
+}
+MappedMap;
+
+static inline char* xmmapped_at(const MappedMap* m, const int x, const int y) {
+    const size_t block = (size_t)(y / MAP_BLOCK) * m->bw + x / MAP_BLOCK;
+    return m->tiles + block * MAP_BLOCK * MAP_BLOCK + (y % MAP_BLOCK) * MAP_BLOCK + x % MAP_BLOCK;
+}
+
+MappedMap xmopen_mapped(const char* path, const int w, const int h);
+void xmclose_mapped(MappedMap* m);
+void xmmapped_blit(MappedMap* m, const Map map, const int x, const int y);
+void xmmapped_read(const MappedMap* m, const Map map, const int x, const int y);
+void xmmapped_generate(MappedMap* m, const MapGenerator* generator, const float* params, int chunk, const unsigned seed);
+void xmmapped_noise(MappedMap* m, const float wall_percent, const unsigned seed);
+void xmmapped_step(MappedMap* m);
+
+#ifdef MAP_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Background generation, compiled in only with MAP_THREADS (pthreads).
+// A MapWorker owns one thread that runs a generator request while the
+// caller keeps using its current map, then hands the new one over:
+// xmworker_poll never blocks, so a render loop can call it every frame
+// and swap when it returns true. finish, if set, also runs on the worker
+// after the generator (decoration, mesh building) and whatever it returns
+// comes back through poll's extra. drop, if set after xmworker_start,
+// frees the extra of a map xmworker_stop finds never taken.
+typedef void* (*MapWorkerFinish)(Map* map, void* user);
+typedef void (*MapWorkerDrop)(void* extra);
+
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    MapWorkerFinish finish;
+    void* user;
+    MapWorkerDrop drop;
+
+    const MapGenerator* generator;
+    float params[MAP_GENERATOR_PARAMS];
+    int w;
+    int h;
+    unsigned seed;
+    bool pending;    // a request waits for the thread
+    bool quit;
+    atomic_bool ready; // result and extra are the caller's to take
+    Map result;
+    void* extra;
+}
+MapWorker;
+
+void xmworker_start(MapWorker* worker, MapWorkerFinish finish, void* user);
+bool xmworker_request(MapWorker* worker, const MapGenerator* generator, const int w, const int h,
+                      const float* params, const unsigned seed);
+bool xmworker_busy(MapWorker* worker);
+bool xmworker_poll(MapWorker* worker, Map* map, void** extra);
+void xmworker_stop(MapWorker* worker);
+
+// Generate-ahead pool. Each slot (a generator, size and params) keeps up
+// to depth maps ready, refilled by the pool's threads while the ready
+// and in-flight maps fit in cap bytes. xmpool_try pops one in O(1) or
+// reports a miss; xmpool_take falls back to generating on the calling
+// thread. Refills draw seeds seed, seed + 1, ... and run finish like
+// MapWorker; drop, if set, frees the extra of a map never taken, and
+// measure, if set, gives an extra's size in bytes so it counts against
+// cap too. A refill reserves the slot's last measured size up front.
+typedef size_t (*MapPoolMeasure)(const void* extra);
+
+typedef struct
+{
+    const MapGenerator* generator;
+    float params[MAP_GENERATOR_PARAMS];
+    int w;
+    int h;
+    Map* ready;   // ring of depth maps from head
+    void** extras;
+    size_t* sizes; // bytes each ready map and its extra hold
+    size_t extra_bytes; // size of the last extra measured
+    int head;
+    int count;
+    int filling;  // refills running for the slot
+}
+MapPoolSlot;
+
+typedef struct
+{
+    long hits;
+    long misses;
+    long refills;
+    double refill_ms;     // mean time of a refill
+    double refill_max_ms;
+    int ready;            // maps waiting over all slots
+    size_t bytes;         // held by ready and in-flight maps
+}
+MapPoolStats;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t* threads;
+    int thread_count;
+    MapPoolSlot* slots;
+    int slot_count;
+    int depth;
+    size_t cap;
+    size_t bytes;
+    unsigned seed;
+    MapWorkerFinish finish;
+    void* user;
+    MapWorkerDrop drop;
+    MapPoolMeasure measure;
+    bool quit;
+    MapPoolStats stats;
+    double refill_total_ms;
+}
+MapPool;
+
+void xmpool_init(MapPool* pool, const int depth, const size_t cap, const unsigned seed, MapWorkerFinish finish, void* user);
+int xmpool_add(MapPool* pool, const MapGenerator* generator, const int w, const int h, const float* params);
+void xmpool_start(MapPool* pool, const int threads);
+bool xmpool_try(MapPool* pool, const int slot, Map* map, void** extra);
+Map xmpool_take(MapPool* pool, const int slot, void** extra);
+void xmpool_stats(MapPool* pool, MapPoolStats* stats);
+void xmpool_stop(MapPool* pool);
+#endif
+
 
 
 
@@ -126,6 +612,208 @@ static void bomb(const char* const message, ...) {
     exit(1);
 }
 
+// Everything a generator mutates outside its own map is thread-local, so
+// any number of threads can generate at once.
+#if defined(_MSC_VER)
+#define MAP_TLS __declspec(thread)
+#else
+#define MAP_TLS _Thread_local
+#endif
+
+// Generators draw from a thread-local copy of glibc's additive feedback
+// generator instead of rand(): the same sequence srand()/rand() give on
+// glibc, but per thread and the same on every platform. An unseeded
+// thread seeds from time(0) on its first draw, so bsp, scatter, room_maze
+// and zorbus, which never call mseed, still vary from run to run.
+#define MAP_RAND_MAX 0x7FFFFFFF
+
+static MAP_TLS uint32_t rng_state[31];
+static MAP_TLS int rng_front;
+static MAP_TLS int rng_rear;
+static MAP_TLS bool rng_seeded;
+
+static int rng_next(void);
+
+static void rng_seed(const unsigned seed) {
+    int32_t word = seed ? (int32_t)seed : 1;
+    rng_state[0] = word;
+    for (int i = 1; i < 31; i++) {
+        // 16807 * word % (2^31 - 1) without overflow.
+        const int32_t hi = word / 127773;
+        const int32_t lo = word % 127773;
+        word = 16807 * lo - 2836 * hi;
+        if (word < 0) word += 2147483647;
+        rng_state[i] = word;
+    }
+    rng_front = 3;
+    rng_rear = 0;
+    rng_seeded = true;
+    for (int i = 0; i < 310; i++) rng_next();
+}
+
+static int rng_next(void) {
+    if (!rng_seeded) rng_seed((unsigned)time(0));
+    rng_state[rng_front] += rng_state[rng_rear];
+    const int result = rng_state[rng_front] >> 1;
+    if (++rng_front == 31) rng_front = 0;
+    if (++rng_rear == 31) rng_rear = 0;
+    return result;
+}
+
+#ifdef MAP_STATS
+static MAP_TLS MapStats map_stats;
+#define MAP_STAT(field, n) (map_stats.field += (n))
+
+static void* mmalloc(const size_t n) {
+    map_stats.mallocs++;
+    map_stats.bytes += n;
+    return MAP_MALLOC(n);
+}
+
+static void* mcalloc(const size_t count, const size_t n) {
+    map_stats.mallocs++;
+    map_stats.bytes += count * n;
+    return MAP_CALLOC(count, n);
+}
+
+static void* mrealloc(void* p, const size_t n) {
+    map_stats.mallocs++;
+    map_stats.bytes += n;
+    return MAP_REALLOC(p, n);
+}
+
+static void mfree(void* p) {
+    if (p) map_stats.frees++;
+    MAP_FREE(p);
+}
+
+static int mrand(void) {
+    map_stats.rng_draws++;
+    return rng_next();
+}
+
+void xmstats(MapStats* stats) {
+    if (stats) *stats = map_stats;
+    zero(map_stats);
+}
+#else
+#define MAP_STAT(field, n) ((void)0)
+#define mmalloc(n) MAP_MALLOC(n)
+#define mcalloc(count, n) MAP_CALLOC(count, n)
+#define mrealloc(p, n) MAP_REALLOC(p, n)
+#define mfree(p) MAP_FREE(p)
+#define mrand() rng_next()
+#endif
+
+#ifdef MAP_TRACE
+#include <stdatomic.h>
+
+#define TRACE_DEPTH 32
+
+typedef struct
+{
+    const char* name;
+    int64_t begin;
+    int64_t end;
+}
+TraceEvent;
+
+typedef struct TraceRing
+{
+    struct TraceRing* next;
+    int tid;
+    int depth;
+    int64_t count;
+    TraceEvent open[TRACE_DEPTH];
+    TraceEvent events[MAP_TRACE_EVENTS];
+}
+TraceRing;
+
+// Rings are never freed: a thread that exits still shows up in the export.
+static _Atomic(TraceRing*) trace_rings;
+static atomic_int trace_threads;
+static MAP_TLS TraceRing* trace_ring;
+
+static int64_t trace_now(void) {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static TraceRing* trace_self(void) {
+    if (trace_ring) return trace_ring;
+    TraceRing* ring = (TraceRing*)MAP_CALLOC(1, sizeof(TraceRing));
+    if (!ring) bomb("trace: out of memory\n");
+    ring->tid = atomic_fetch_add(&trace_threads, 1) + 1;
+    ring->next = atomic_load(&trace_rings);
+    while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring));
+    return trace_ring = ring;
+}
+
+static void trace_begin(const char* name) {
+    TraceRing* ring = trace_self();
+    if (ring->depth < TRACE_DEPTH) ring->open[ring->depth] = (TraceEvent){ name, trace_now(), 0 };
+    ring->depth++;
+}
+
+static void trace_end(void) {
+    TraceRing* ring = trace_self();
+    if (ring->depth == 0) return;
+    if (--ring->depth >= TRACE_DEPTH) return;
+    TraceEvent e = ring->open[ring->depth];
+    e.end = trace_now();
+    ring->events[ring->count++ % MAP_TRACE_EVENTS] = e;
+}
+
+bool xmtrace_write(FILE* out) {
+    int64_t origin = INT64_MAX;
+    for (TraceRing* r = atomic_load(&trace_rings); r; r = r->next) {
+        const int64_t n = r->count < MAP_TRACE_EVENTS ? r->count : MAP_TRACE_EVENTS;
+        for (int64_t i = 0; i < n; i++)
+            if (r->events[i].begin < origin) origin = r->events[i].begin;
+    }
+    fprintf(out, "{\"traceEvents\":[");
+    bool first = true;
+    for (TraceRing* r = atomic_load(&trace_rings); r; r = r->next) {
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"map %d\"}}",
+                first ? "" : ",", r->tid, r->tid);
+        first = false;
+        const int64_t n = r->count < MAP_TRACE_EVENTS ? r->count : MAP_TRACE_EVENTS;
+        const int64_t oldest = r->count - n;
+        for (int64_t i = oldest; i < r->count; i++) {
+            const TraceEvent* e = &r->events[i % MAP_TRACE_EVENTS];
+            fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"map\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    e->name, r->tid, (e->begin - origin) / 1e3, (e->end - e->begin) / 1e3);
+        }
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return !ferror(out);
+}
+
+void xmtrace_clear(void) {
+    for (TraceRing* r = atomic_load(&trace_rings); r; r = r->next) r->count = 0;
+}
+
+#define MAP_BEGIN(name) trace_begin(name)
+#define MAP_END() trace_end()
+#else
+#define MAP_BEGIN(name) ((void)0)
+#define MAP_END() ((void)0)
+#endif
+
+static MAP_TLS unsigned map_seed;
+static MAP_TLS bool map_seeded;
+
+void xmseed(const unsigned seed) {
+    map_seed = seed;
+    map_seeded = true;
+    rng_seed(seed);
+}
+
+static void mseed(void) {
+    rng_seed(map_seeded ? map_seed : (unsigned)time(0));
+}
+
 static char** reset(char** block, const int h, const int w, const int blok) {
     for (int row = 0; row < h; row++)
         for (int col = 0; col < w; col++)
@@ -133,11 +821,17 @@ static char** reset(char** block, const int h, const int w, const int blok) {
     return block;
 }
 
+// One allocation: h row pointers followed by the h * w tiles, so rows are
+// contiguous from block[0] and the whole grid goes with a single mfree.
+// NULL if the allocation fails.
 static char** bnew(const int h, const int w, const int blok) {
-    char** block = toss(char*, h);
+    char** block = (char**)mmalloc(h * sizeof(char*) + (size_t)h * w);
+    if (!block) return NULL;
+    char* tiles = (char*)(block + h);
     for (int row = 0; row < h; row++)
-        block[row] = toss(char, w);
-    return reset(block, h, w, blok);
+        block[row] = tiles + (size_t)row * w;
+    memset(tiles, blok, (size_t)h * w);
+    return block;
 }
 
 static Map mnew(const int h, const int w) {
@@ -285,9 +979,9 @@ static Tris delaunay(const Points ps, const int w, const int h, const int max, c
         out = ejoin(out, edges, p, flags);
         tris = out;
     }
-    free(dummy);
-    free(in.tri);
-    free(edges.tri);
+    mfree(dummy);
+    mfree(in.tri);
+    mfree(edges.tri);
     return tris;
 }
 
@@ -295,8 +989,8 @@ static Points prand(const int w, const int h, const int max, const int grid, con
     Points ps = psnew(max);
     for (int i = ps.count; i < ps.max; i++) {
         const Point p = {
-            (float)(rand() % (w - border) + border / 2),
-            (float)(rand() % (h - border) + border / 2),
+            (float)(mrand() % (w - border) + border / 2),
+            (float)(mrand() % (h - border) + border / 2),
         };
         const Point snapped = snap(p, grid);
         ps = psadd(ps, snapped);
@@ -353,9 +1047,9 @@ static int connected(const Point a, const Point b, const Tris edges, const Flags
                 todo = psadd(todo, reach.tri[i].b);
         }
     }
-    free(todo.point);
-    free(reach.tri);
-    free(done.point);
+    mfree(todo.point);
+    mfree(reach.tri);
+    mfree(done.point);
     return connection;
 }
 
@@ -426,12 +1120,12 @@ static void mcorridor(const Map map, const Point a, const Point b) {
 }
 
 static void mpillar(const Map map, const Point where, const int w, const int h) {
-    int type = rand() % 3;
+    int type = mrand() % 3;
     if (type == 1) {
-        int numPIllar = rand() % 10 + 2;
+        int numPIllar = mrand() % 10 + 2;
         for (int i = 0; i < numPIllar; i++) {
-            int xx = (int)where.x + rand() % w;
-            int yy = (int)where.y + rand() % h;
+            int xx = (int)where.x + mrand() % w;
+            int yy = (int)where.y + mrand() % h;
             if (yy >= 0 && yy < map.h && xx >= 0 && xx < map.w) {
                 if (map.walling[yy][xx] == ' ') {
                     map.walling[yy][xx] = '#';
@@ -465,40 +1159,114 @@ static void carve(const Map map, const Tris edges, const Flags flags, const int
             continue;
         const int min = 2;
         const int size = grid / 2 - min;
-        const int w = min + rand() % (size > 0 ? size : 1);
-        const int h = min + rand() % (size > 0 ? size : 1);
+        const int w = min + mrand() % (size > 0 ? size : 1);
+        const int h = min + mrand() % (size > 0 ? size : 1);
         bone(map, e, w, h);
     }
 }
 
 Map xmgen(const int w, const int h, const int grid, const int max) {
-    srand((unsigned)time(0));
+    mseed();
+    MAP_BEGIN("xmgen");
     const Flags flags = { { 0.0f, 0.0f }, { 1.0f, 1.0f } };
     const int border = 3 * grid;
+    MAP_BEGIN("prand");
     const Points ps = prand(w, h, max, grid, border);
+    MAP_END();
+    MAP_BEGIN("delaunay");
     const Tris tris = delaunay(ps, w, h, 9 * max, flags);
     const Tris edges = ecollect(tsnew(27 * max), tris, flags);
+    MAP_END();
+    MAP_BEGIN("revdel");
     revdel(edges, w, h, flags);
+    MAP_END();
+    MAP_BEGIN("carve");
     const Map map = mnew(h, w);
     mdups(edges, flags);
     carve(map, edges, flags, grid);
-    free(tris.tri);
-    free(ps.point);
-    free(edges.tri);
+    MAP_END();
+    mfree(tris.tri);
+    mfree(ps.point);
+    mfree(edges.tri);
+    MAP_END();
     return map;
 }
 
 void xmclose(const Map map) {
-    for (int row = 0; row < map.h; row++)
-        free(map.walling[row]);
-    free(map.walling);
+    mfree(map.walling);
+}
+
+// Same colours as DrawMinimap in the demo: raylib's BROWN for anything
+// else, then DARKGRAY, BLUE, RED, ORANGE and GREEN.
+static const unsigned char write_palette[][3] = {
+    { 127, 106, 79 }, { 80, 80, 80 }, { 0, 121, 241 }, { 230, 41, 55 }, { 255, 161, 0 }, { 0, 228, 48 },
+};
+
+static int write_colour(const char tile) {
+    return tile == '#' ? 1 : tile == '?' ? 2 : tile == '*' ? 3 : tile == '|' ? 4 : tile == '"' ? 5 : 0;
+}
+
+bool xmwrite(const Map map, FILE* out, const int format) {
+    if (format < MAP_WRITE_ASCII || format > MAP_WRITE_PGM) return false;
+    // Worst case is an ANSI escape per tile plus the reset at the end of a row.
+    const size_t size = format == MAP_WRITE_ANSI ? 20 * (size_t)map.w + 8 : 3 * (size_t)map.w + 1;
+    char* line = toss(char, size);
+    if (format == MAP_WRITE_PPM || format == MAP_WRITE_PGM)
+        fprintf(out, "P%c\n%d %d\n255\n", format == MAP_WRITE_PPM ? '6' : '5', map.w, map.h);
+
+    for (int y = 0; y < map.h; y++) {
+        const char* row = map.walling[y];
+        size_t n = 0;
+        if (format == MAP_WRITE_ASCII) {
+            memcpy(line, row, map.w);
+            n = map.w;
+            line[n++] = '\n';
+        }
+        else if (format == MAP_WRITE_ANSI) {
+            // An escape only where the colour changes.
+            int last = -1;
+            for (int x = 0; x < map.w; x++) {
+                const int c = write_colour(row[x]);
+                if (c != last) {
+                    const unsigned char* rgb = write_palette[c];
+                    n += sprintf(line + n, "\x1b[38;2;%d;%d;%dm", rgb[0], rgb[1], rgb[2]);
+                    last = c;
+                }
+                line[n++] = row[x];
+            }
+            memcpy(line + n, "\x1b[0m\n", 5);
+            n += 5;
+        }
+        else {
+            for (int x = 0; x < map.w; x++) {
+                const unsigned char* rgb = write_palette[write_colour(row[x])];
+                if (format == MAP_WRITE_PPM) {
+                    memcpy(line + n, rgb, 3);
+                    n += 3;
+                }
+                else line[n++] = (char)((299 * rgb[0] + 587 * rgb[1] + 114 * rgb[2]) / 1000);
+            }
+        }
+        fwrite(line, 1, n, out);
+    }
+    mfree(line);
+    return !ferror(out);
 }
 
 void xmprint(const Map map) {
+    xmwrite(map, stdout, MAP_WRITE_ASCII);
+    putchar('\n');
+}
+
+uint64_t xmhash(const Map map) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    // Sizes go in as little-endian bytes so the hash is the same on any host.
+    for (int i = 0; i < 8; i++)
+        hash = (hash ^ (((unsigned)(i < 4 ? map.w : map.h) >> (8 * (i % 4))) & 0xFF)) * 0x100000001b3ull;
     for (int row = 0; row < map.h; row++)
         for (int col = 0; col < map.w; col++)
-            printf("%c%s", map.walling[row][col], col == map.w - 1 ? "\n" : "");
-    putchar('\n');
+            hash = (hash ^ (unsigned char)map.walling[row][col]) * 0x100000001b3ull;
+    return hash;
 }
 
 /* ===================== Rooms & BSP connectivity utils ===================== */
@@ -508,6 +1276,129 @@ void xmprint(const Map map) {
 //static int room_count = 0;
 
 
+/* ---------- MapInfo collection ---------- */
+
+// Info arrays grow by doubling once they pass 8 entries.
+static void* info_grow(void* items, const int count, const size_t size) {
+    if (count == 0) return mmalloc(8 * size);
+    if (count < 8 || (count & (count - 1))) return items;
+    return mrealloc(items, 2 * count * size);
+}
+
+static void info_room(MapInfo* info, const Rect r) {
+    if (!info) return;
+    info->rooms = (Rect*)info_grow(info->rooms, info->room_count, sizeof(Rect));
+    info->rooms[info->room_count++] = r;
+}
+
+static void info_door(MapInfo* info, const int x, const int y, const int room) {
+    if (!info) return;
+    info->doors = (MapDoor*)info_grow(info->doors, info->door_count, sizeof(MapDoor));
+    info->doors[info->door_count++] = (MapDoor){x, y, room};
+}
+
+static void info_corridor(MapInfo* info, const int a, const int b, const int x1, const int y1, const int x2, const int y2) {
+    if (!info) return;
+    info->corridors = (MapCorridor*)info_grow(info->corridors, info->corridor_count, sizeof(MapCorridor));
+    info->corridors[info->corridor_count++] = (MapCorridor){a, b, {x1, y1}, {x2, y2}};
+}
+
+// Index of the first room whose rectangle holds (x, y), or -1.
+static int info_room_at(const MapInfo* info, const int x, const int y) {
+    for (int i = 0; i < info->room_count; i++) {
+        const Rect r = info->rooms[i];
+        if (x >= r.x && x < r.x + r.w && y >= r.y && y < r.y + r.h) return i;
+    }
+    return -1;
+}
+
+// Doors of rectangular rooms: every run of floor along a side, just outside
+// the rectangle, is one opening and is recorded at its middle tile.
+static void info_ring_doors(MapInfo* info, const Map map) {
+    if (!info) return;
+    for (int i = 0; i < info->room_count; i++) {
+        const Rect r = info->rooms[i];
+        const int side_x[4] = { r.x, r.x, r.x - 1, r.x + r.w };
+        const int side_y[4] = { r.y - 1, r.y + r.h, r.y, r.y };
+        for (int s = 0; s < 4; s++) {
+            const int horizontal = s < 2;
+            const int len = horizontal ? r.w : r.h;
+            int run = 0;
+            for (int k = 0; k <= len; k++) {
+                const int x = side_x[s] + (horizontal ? k : 0);
+                const int y = side_y[s] + (horizontal ? 0 : k);
+                if (k < len && x >= 0 && y >= 0 && x < map.w && y < map.h && map.walling[y][x] != '#') {
+                    run++;
+                    continue;
+                }
+                if (run > 0) {
+                    const int mid = k - (run + 1) / 2;
+                    info_door(info, side_x[s] + (horizontal ? mid : 0), side_y[s] + (horizontal ? 0 : mid), i);
+                }
+                run = 0;
+            }
+        }
+    }
+}
+
+// Builds the CSR room graph from corridors that join two different rooms;
+// neighbour lists come out sorted and without repeats.
+static void info_finish(MapInfo* info) {
+    if (!info) return;
+    const int n = info->room_count;
+    int* start = (int*)mcalloc(n + 1, sizeof(int));
+    for (int i = 0; i < info->corridor_count; i++) {
+        const MapCorridor c = info->corridors[i];
+        if (c.a < 0 || c.b < 0 || c.a == c.b) continue;
+        start[c.a + 1]++;
+        start[c.b + 1]++;
+    }
+    for (int i = 0; i < n; i++) start[i + 1] += start[i];
+    int* adjacency = toss(int, start[n] ? start[n] : 1);
+    int* fill = toss(int, n ? n : 1);
+    for (int i = 0; i < n; i++) fill[i] = start[i];
+    for (int i = 0; i < info->corridor_count; i++) {
+        const MapCorridor c = info->corridors[i];
+        if (c.a < 0 || c.b < 0 || c.a == c.b) continue;
+        adjacency[fill[c.a]++] = c.b;
+        adjacency[fill[c.b]++] = c.a;
+    }
+    int out = 0;
+    for (int i = 0; i < n; i++) {
+        const int from = start[i];
+        const int to = start[i + 1];
+        for (int j = from + 1; j < to; j++) {
+            const int v = adjacency[j];
+            int k = j;
+            while (k > from && adjacency[k - 1] > v) {
+                adjacency[k] = adjacency[k - 1];
+                k--;
+            }
+            adjacency[k] = v;
+        }
+        start[i] = out;
+        int last = -1;
+        for (int j = from; j < to; j++)
+            if (adjacency[j] != last) {
+                last = adjacency[j];
+                adjacency[out++] = last;
+            }
+    }
+    start[n] = out;
+    mfree(fill);
+    info->adjacency_start = start;
+    info->adjacency = adjacency;
+}
+
+void xminfo_free(MapInfo* info) {
+    mfree(info->rooms);
+    mfree(info->doors);
+    mfree(info->corridors);
+    mfree(info->adjacency_start);
+    mfree(info->adjacency);
+    zero(*info);
+}
+
 static void create_corridor(Map map, int x1, int y1, int x2, int y2) {
     int x = x1, y = y1;
     while (x != x2 || y != y2) {
@@ -542,10 +1433,11 @@ static inline int room_distance2(Rect a, Rect b) {
 }
 
 
-static void connect_rooms(Map map, Rect* rooms, int count) {
+static void connect_rooms(Map map, Rect* rooms, int count, MapInfo* info) {
     if (count <= 1) return;
+    MAP_BEGIN("connect_rooms");
 
-    bool* connected_flags = (bool*)calloc(count, sizeof(bool));
+    bool* connected_flags = (bool*)mcalloc(count, sizeof(bool));
     connected_flags[0] = true;
     int connected_num = 1;
 
@@ -569,12 +1461,14 @@ static void connect_rooms(Map map, Rect* rooms, int count) {
         room_center(rooms[bestA], &x1, &y1);
         room_center(rooms[bestB], &x2, &y2);
         create_corridor(map, x1, y1, x2, y2);
+        info_corridor(info, bestA, bestB, x1, y1, x2, y2);
 
         connected_flags[bestB] = true;
         connected_num++;
     }
 
-    free(connected_flags);
+    mfree(connected_flags);
+    MAP_END();
 }
 
 
@@ -583,7 +1477,8 @@ static void connect_rooms(Map map, Rect* rooms, int count) {
 /* ===================== Subtractive Generator ===================== */
 
 Map xmgen_subtractive(const int w, const int h, const int carve_count) {
-    srand((unsigned)time(0));
+    mseed();
+    MAP_BEGIN("xmgen_subtractive");
     Map map = mnew(h, w);
     
 
@@ -591,15 +1486,15 @@ Map xmgen_subtractive(const int w, const int h, const int carve_count) {
 
     for (int i = 0; i < carve_count; i++) {
 
-        int x = rand() % w;
-        int y = rand() % h;
+        int x = mrand() % w;
+        int y = mrand() % h;
 
         for (int j = 0; j < 500; j++) {
             if (x >= 0 && x < w && y >= 0 && y < h) {
                 map.walling[y][x] = ' ';
             }
 
-            int dir = rand() % 4;
+            int dir = mrand() % 4;
             if (dir == 0) x++;
             else if (dir == 1) x--;
             else if (dir == 2) y++;
@@ -624,6 +1519,7 @@ Map xmgen_subtractive(const int w, const int h, const int carve_count) {
         }
     }
     xmclose(map);
+    MAP_END();
     return new_map;
 }
 
@@ -638,20 +1534,23 @@ typedef struct {
     bool connected;
 } GraphRoom;
 
-Map xmgen_graph(const int w, const int h, const int num_rooms, const int min_size, const int max_size, const int extra_connections) {
-    srand((unsigned)time(0));
+Map xmgen_graph(const int w, const int h, const int num_rooms, const int min_size, const int max_size, const int extra_connections, MapInfo* info) {
+    mseed();
+    MAP_BEGIN("xmgen_graph");
     Map map = mnew(h, w);
+    if (info) zero(*info);
     
     GraphRoom* rooms = toss(GraphRoom, num_rooms);
     int room_count = 0;
     int attempts = 0;
+    MAP_BEGIN("place rooms");
 
     while (room_count < num_rooms && attempts < num_rooms * 5) {
         Rect r;
-        r.w = min_size + rand() % (max_size - min_size + 1);
-        r.h = min_size + rand() % (max_size - min_size + 1);
-        r.x = 1 + rand() % (w - r.w - 1);
-        r.y = 1 + rand() % (h - r.h - 1);
+        r.w = min_size + mrand() % (max_size - min_size + 1);
+        r.h = min_size + mrand() % (max_size - min_size + 1);
+        r.x = 1 + mrand() % (w - r.w - 1);
+        r.y = 1 + mrand() % (h - r.h - 1);
 
         bool overlap = false;
         for (int i = 0; i < room_count; i++) {
@@ -663,14 +1562,17 @@ Map xmgen_graph(const int w, const int h, const int num_rooms, const int min_siz
             }
         }
 
-        if (!overlap) {
+        if (overlap) MAP_STAT(rejected, 1);
+        else {
             rooms[room_count].rect = r;
             rooms[room_count].connected = false;
             room_count++;
         }
         attempts++;
     }
+    MAP_END();
     
+    MAP_BEGIN("connect");
     if (room_count > 0) {
         rooms[0].connected = true;
         int connected_count = 1;
@@ -703,23 +1605,27 @@ Map xmgen_graph(const int w, const int h, const int num_rooms, const int min_siz
                 room_center(rooms[best_room_idx].rect, &x1, &y1);
                 room_center(rooms[best_neighbor_idx].rect, &x2, &y2);
                 create_corridor(map, x1, y1, x2, y2);
+                info_corridor(info, best_room_idx, best_neighbor_idx, x1, y1, x2, y2);
                 rooms[best_room_idx].connected = true;
                 connected_count++;
             }
         }
 
         for (int i = 0; i < extra_connections; i++) {
-            int room1 = rand() % room_count;
-            int room2 = rand() % room_count;
+            int room1 = mrand() % room_count;
+            int room2 = mrand() % room_count;
             if (room1 != room2) {
                 int x1, y1, x2, y2;
                 room_center(rooms[room1].rect, &x1, &y1);
                 room_center(rooms[room2].rect, &x2, &y2);
                 create_corridor(map, x1, y1, x2, y2);
+                info_corridor(info, room1, room2, x1, y1, x2, y2);
             }
         }
     }
+    MAP_END();
     
+    MAP_BEGIN("carve rooms");
     for (int i = 0; i < room_count; i++) {
         Rect r = rooms[i].rect;
         for (int y = r.y; y < r.y + r.h; y++) {
@@ -729,9 +1635,14 @@ Map xmgen_graph(const int w, const int h, const int num_rooms, const int min_siz
                 }
             }
         }
+        info_room(info, r);
     }
+    MAP_END();
+    info_ring_doors(info, map);
+    info_finish(info);
 
-    free(rooms);
+    mfree(rooms);
+    MAP_END();
     return map;
 }
 
@@ -756,19 +1667,25 @@ static int count_wall_neighbors(Map map, int x, int y) {
 }
 
 Map xmgen_cellular(const int w, const int h, const float wall_percent, const int iterations) {
-    srand((unsigned)time(0));
+    mseed();
+    MAP_BEGIN("xmgen_cellular");
     Map map = mnew(h, w);
+    MAP_BEGIN("noise");
     for (int y = 0; y < h; y++) {
         for (int x = 0; x < w; x++) {
             if (x == 0 || x == w - 1 || y == 0 || y == h - 1) {
                 map.walling[y][x] = '#';
             } else {
-                map.walling[y][x] = ((float)rand() / RAND_MAX) < wall_percent ? '#' : ' ';
+                map.walling[y][x] = ((float)mrand() / MAP_RAND_MAX) < wall_percent ? '#' : ' ';
             }
         }
     }
+    MAP_END();
+    MAP_BEGIN("automaton");
     char** buffer_map = bnew(h, w, '#');
     for (int iter = 0; iter < iterations; iter++) {
+        MAP_STAT(ca_iterations, 1);
+        MAP_STAT(cells_visited, w * h);
         for (int y = 0; y < h; y++) {
             for (int x = 0; x < w; x++) {
                 if (x == 0 || x == w - 1 || y == 0 || y == h - 1) {
@@ -797,20 +1714,20 @@ Map xmgen_cellular(const int w, const int h, const float wall_percent, const int
             }
         }
     }
-    for (int row = 0; row < map.h; row++)
-        free(buffer_map[row]);
-    free(buffer_map);
+    MAP_END();
+    mfree(buffer_map);
+    MAP_END();
     return map;
 }
 
 #define PERLIN_TABLE_SIZE 256
-static int p[2 * PERLIN_TABLE_SIZE];
+static MAP_TLS int p[2 * PERLIN_TABLE_SIZE];
 
 static void init_perlin() {
     int perm[PERLIN_TABLE_SIZE];
     for (int i = 0; i < PERLIN_TABLE_SIZE; i++) perm[i] = i;
     for (int i = 0; i < PERLIN_TABLE_SIZE; i++) {
-        int swap_idx = rand() % PERLIN_TABLE_SIZE;
+        int swap_idx = mrand() % PERLIN_TABLE_SIZE;
         int temp = perm[i];
         perm[i] = perm[swap_idx];
         perm[swap_idx] = temp;
@@ -842,7 +1759,8 @@ static float perlin(float x, float y) {
 }
 
 Map xmgen_perlin(const int w, const int h, const float threshold) {
-    srand((unsigned)time(0));
+    mseed();
+    MAP_BEGIN("xmgen_perlin");
     init_perlin();
     Map map = mnew(h, w);
     for (int y = 0; y < h; y++) {
@@ -853,84 +1771,27 @@ Map xmgen_perlin(const int w, const int h, const float threshold) {
             }
         }
     }
+    MAP_END();
     return map;
 }
 
 /* ----------------------- Region tools for CA shapes ---------------------- */
 
-static void ca_flood_fill(int x, int y, char** tiles, int w, int h, int region_id, int** regions) {
-    if (x < 0 || y < 0 || x >= w || y >= h || regions[y][x] != 0 || tiles[y][x] == '#') {
-        return;
-    }
-    regions[y][x] = region_id;
-    ca_flood_fill(x + 1, y, tiles, w, h, region_id, regions);
-    ca_flood_fill(x - 1, y, tiles, w, h, region_id, regions);
-    ca_flood_fill(x, y + 1, tiles, w, h, region_id, regions);
-    ca_flood_fill(x, y - 1, tiles, w, h, region_id, regions);
-}
-
 static void isolate_largest_region(char** tiles, int w, int h) {
-    int** regions = toss(int*, h);
-    for (int i = 0; i < h; i++) {
-        regions[i] = toss(int, w);
-        memset(regions[i], 0, w * sizeof(int));
-    }
-
-    int region_id = 1;
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            if (tiles[y][x] == ' ' && regions[y][x] == 0) {
-                ca_flood_fill(x, y, tiles, w, h, region_id, regions);
-                region_id++;
-            }
-        }
-    }
-
-    if (region_id <= 2) {
-        for (int i = 0; i < h; i++) free(regions[i]);
-        free(regions);
-        return;
-    }
-
-    int* region_sizes = (int*)calloc(region_id, sizeof(int));
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            if (regions[y][x] != 0) {
-                region_sizes[regions[y][x]]++;
-            }
-        }
-    }
-
-    int largest_region_id = 0;
-    int max_size = 0;
-    for (int i = 1; i < region_id; i++) {
-        if (region_sizes[i] > max_size) {
-            max_size = region_sizes[i];
-            largest_region_id = i;
-        }
-    }
-
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            if (regions[y][x] != largest_region_id) {
-                tiles[y][x] = '#';
-            }
-        }
-    }
-
-    free(region_sizes);
-    for (int i = 0; i < h; i++) free(regions[i]);
-    free(regions);
+    Map shape = {tiles, h, w};
+    xmconnect(&shape, MAP_CONNECT_DROP_SMALL);
 }
 
 static void generate_ca_shape(char** tiles, int w, int h) {
     float wall_chance = 0.1f;
     for(int y=0; y<h; y++) for(int x=0; x<w; x++) {
-        tiles[y][x] = (rand() % 100 < wall_chance * 100) ? '#' : ' ';
+        tiles[y][x] = (mrand() % 100 < wall_chance * 100) ? '#' : ' ';
     }
 
     char** buffer = bnew(h, w, '#');
     for (int i = 0; i < 5; i++) {
+        MAP_STAT(ca_iterations, 1);
+        MAP_STAT(cells_visited, w * h);
         for (int y = 0; y < h; y++) {
             for (int x = 0; x < w; x++) {
                 int neighbors = 0;
@@ -950,8 +1811,7 @@ static void generate_ca_shape(char** tiles, int w, int h) {
         }
         for(int y=0; y<h; y++) memcpy(tiles[y], buffer[y], w * sizeof(char));
     }
-    for(int y=0; y<h; y++) free(buffer[y]);
-    free(buffer);
+    mfree(buffer);
 
     isolate_largest_region(tiles, w, h);
 }
@@ -960,11 +1820,11 @@ static void generate_ca_shape(char** tiles, int w, int h) {
 
 static BrogueRoom create_brogue_room(int min_size, int max_size) {
     BrogueRoom room;
-    room.w = min_size + rand() % (max_size - min_size);
-    room.h = min_size + rand() % (max_size - min_size);
+    room.w = min_size + mrand() % (max_size - min_size);
+    room.h = min_size + mrand() % (max_size - min_size);
     room.tiles = bnew(room.h, room.w, '#');
 
-    int type = rand() % 3;
+    int type = mrand() % 3;
     if (type == 0) {
         for (int y = 1; y < room.h - 1; y++) for (int x = 1; x < room.w - 1; x++) room.tiles[y][x] = ' ';
     } else if (type == 1) {
@@ -980,19 +1840,19 @@ static BrogueRoom create_brogue_room(int min_size, int max_size) {
         generate_ca_shape(room.tiles, room.w, room.h);
     }
 
-    room.door_x[0] = 1 + rand() % (room.w - 2); room.door_y[0] = 0;
-    room.door_x[1] = room.w - 1;              room.door_y[1] = 1 + rand() % (room.h - 2);
-    room.door_x[2] = 1 + rand() % (room.w - 2); room.door_y[2] = room.h - 1;
-    room.door_x[3] = 0;                       room.door_y[3] = 1 + rand() % (room.h - 2);
+    room.door_x[0] = 1 + mrand() % (room.w - 2); room.door_y[0] = 0;
+    room.door_x[1] = room.w - 1;              room.door_y[1] = 1 + mrand() % (room.h - 2);
+    room.door_x[2] = 1 + mrand() % (room.w - 2); room.door_y[2] = room.h - 1;
+    room.door_x[3] = 0;                       room.door_y[3] = 1 + mrand() % (room.h - 2);
 
-    if (rand() % 100 < 15) {
+    if (mrand() % 100 < 15) {
         int hw = room.w + 6, hh = room.h + 6;
         char** hallway_tiles = bnew(hh, hw, '#');
         for(int y=0; y<room.h; y++) for(int x=0; x<room.w; x++) {
             hallway_tiles[y+3][x+3] = room.tiles[y][x];
         }
 
-        int hall_dir = rand() % 4;
+        int hall_dir = mrand() % 4;
         if (hall_dir == 0) {
             for(int y=0; y<=3; y++) hallway_tiles[y][hw/2] = ' ';
             for(int i=0; i<4; i++) { room.door_x[i] = hw/2; room.door_y[i] = 0; }
@@ -1007,7 +1867,7 @@ static BrogueRoom create_brogue_room(int min_size, int max_size) {
             for(int i=0; i<4; i++) { room.door_x[i] = 0; room.door_y[i] = hh/2; }
         }
 
-        for(int y=0; y<room.h; y++) free(room.tiles[y]); free(room.tiles);
+        mfree(room.tiles);
         room.tiles = hallway_tiles;
         room.w = hw; room.h = hh;
     }
@@ -1015,98 +1875,475 @@ static BrogueRoom create_brogue_room(int min_size, int max_size) {
     return room;
 }
 
-/* ---------------------------- Maze generators ---------------------------- */
+/* ---------------------------- Maze helpers ------------------------------ */
 
-Map xmgen_maze(const int wR, const int hR, const int w, const int h) {
-    int maze_w = (w % 2 == 0) ? w + 1 : w;
-    if (maze_w < 3) maze_w = 3;
-    int maze_h = (h % 2 == 0) ? h + 1 : h;
-    if (maze_h < 3) maze_h = 3;
+// Union-find root with path halving.
+static int uf_find(int* parent, int l) {
+    while (parent[l] != l) {
+        parent[l] = parent[parent[l]];
+        l = parent[l];
+    }
+    return l;
+}
 
-    srand((unsigned)time(0));
-    Map map = mnew(hR, wR);
+// Number of non-wall orthogonal neighbours of an interior tile.
+static int floor_exits(const Map map, const int x, const int y) {
+    return (map.walling[y - 1][x] != '#') + (map.walling[y + 1][x] != '#') +
+           (map.walling[y][x - 1] != '#') + (map.walling[y][x + 1] != '#');
+}
 
-    int* stack_x = toss(int, maze_w * maze_h);
-    int* stack_y = toss(int, maze_w * maze_h);
-    int stack_top = 0;
+/* -------------------------- Compact maze graphs -------------------------- */
 
-    int cx = 1;
-    int cy = 1;
-    map.walling[cy][cx] = ' ';
+// Each cell keeps only its east and south passages (the west and north ones
+// belong to the neighbours), packed four cells to a byte.
+#define MAZE_EAST  1
+#define MAZE_SOUTH 2
 
-    stack_x[stack_top] = cx;
-    stack_y[stack_top] = cy;
-    stack_top++;
+static inline int mzget(const MazeGraph maze, const int c) {
+    return (maze.bits[c >> 2] >> ((c & 3) * 2)) & 3;
+}
 
-    int dx[] = {0, 2, 0, -2};
-    int dy[] = {-2, 0, 2, 0};
-    int wall_dx[] = {0, 1, 0, -1};
-    int wall_dy[] = {-1, 0, 1, 0};
+static inline void mzset(const MazeGraph maze, const int c, const int wall) {
+    maze.bits[c >> 2] |= (unsigned char)(wall << ((c & 3) * 2));
+}
 
-    while (stack_top > 0) {
-        cx = stack_x[stack_top - 1];
-        cy = stack_y[stack_top - 1];
+static inline void mzclear(const MazeGraph maze, const int c, const int wall) {
+    maze.bits[c >> 2] &= (unsigned char)~(wall << ((c & 3) * 2));
+}
 
-        int valid_neighbors[4];
+// Opening mask of cell c in N, E, S, W order (bit 0 = north).
+static inline int mzopen(const MazeGraph maze, const int c) {
+    const int i = c % maze.w;
+    const int here = mzget(maze, c);
+    int open = (here & MAZE_EAST) << 1 | (here & MAZE_SOUTH) << 1;
+    if (c >= maze.w && (mzget(maze, c - maze.w) & MAZE_SOUTH)) open |= 1;
+    if (i > 0 && (mzget(maze, c - 1) & MAZE_EAST)) open |= 8;
+    return open;
+}
+
+static inline int mzdegree(const MazeGraph maze, const int c) {
+    const int open = mzopen(maze, c);
+    return (open & 1) + (open >> 1 & 1) + (open >> 2 & 1) + (open >> 3 & 1);
+}
+
+// Adds (or with close set, removes) the passage from c in direction dir.
+static void mzlink(const MazeGraph maze, const int c, const int dir, const bool close) {
+    const int owner = dir == 0 ? c - maze.w : dir == 3 ? c - 1 : c;
+    const int wall = (dir == 0 || dir == 2) ? MAZE_SOUTH : MAZE_EAST;
+    if (close) mzclear(maze, owner, wall);
+    else mzset(maze, owner, wall);
+}
+
+// Neighbours of c in N, E, S, W order that exist inside the maze.
+static int mzneighbors(const MazeGraph maze, const int c, int* out) {
+    const int i = c % maze.w;
+    const int j = c / maze.w;
+    out[0] = j > 0 ? c - maze.w : -1;
+    out[1] = i < maze.w - 1 ? c + 1 : -1;
+    out[2] = j < maze.h - 1 ? c + maze.w : -1;
+    out[3] = i > 0 ? c - 1 : -1;
+    return 4;
+}
+
+MazeGraph xmmaze_new(const int w, const int h) {
+    MazeGraph maze;
+    maze.w = w;
+    maze.h = h;
+    maze.bits = (unsigned char*)mcalloc((w * h + 3) / 4, 1);
+    return maze;
+}
+
+void xmmaze_free(const MazeGraph maze) {
+    mfree(maze.bits);
+}
+
+// Recursive backtracker from cell 0. A cell counts as visited once it has
+// a passage, and the way back is a 2-bit trail of the directions taken, so
+// carving needs a quarter byte per cell on top of the maze itself.
+void xmmaze_carve(const MazeGraph maze) {
+    const int cells = maze.w * maze.h;
+    if (cells <= 1) return;
+
+    unsigned char* trail = (unsigned char*)mmalloc((cells + 3) / 4);
+    const int back[] = {maze.w, -1, -maze.w, 1};
+    int top = 0;
+    int c = 0;
+
+    for (;;) {
+        int next[4];
+        int valid_neighbors[4];
         int neighbor_count = 0;
-        for (int i = 0; i < 4; i++) {
-            int nx = cx + dx[i];
-            int ny = cy + dy[i];
-            if (nx > 0 && nx < maze_w - 1 && ny > 0 && ny < maze_h - 1 && map.walling[ny][nx] == '#') {
-                valid_neighbors[neighbor_count++] = i;
-            }
-        }
+        mzneighbors(maze, c, next);
+        for (int k = 0; k < 4; k++)
+            if (next[k] >= 0 && mzdegree(maze, next[k]) == 0)
+                valid_neighbors[neighbor_count++] = k;
 
         if (neighbor_count > 0) {
-            int rand_idx = rand() % neighbor_count;
-            int chosen_dir = valid_neighbors[rand_idx];
+            const int dir = valid_neighbors[mrand() % neighbor_count];
+            mzlink(maze, c, dir, false);
+            trail[top >> 2] = (unsigned char)((trail[top >> 2] & ~(3 << ((top & 3) * 2))) | dir << ((top & 3) * 2));
+            top++;
+            c = next[dir];
+        } else {
+            if (top == 0) break;
+            top--;
+            c += back[(trail[top >> 2] >> ((top & 3) * 2)) & 3];
+        }
+    }
+    mfree(trail);
+}
+
+// Opens one extra wall at every dead end with the given chance, preferring
+// a neighbour that is a dead end too, so loops replace the dead ends.
+void xmmaze_braid(const MazeGraph maze, const float chance) {
+    const int cells = maze.w * maze.h;
+    for (int c = 0; c < cells; c++) {
+        if (mzdegree(maze, c) != 1) continue;
+        if ((float)mrand() / MAP_RAND_MAX >= chance) continue;
+
+        int next[4];
+        int closed[4];
+        int dead[4];
+        int closed_count = 0;
+        int dead_count = 0;
+        const int open = mzopen(maze, c);
+        mzneighbors(maze, c, next);
+        for (int k = 0; k < 4; k++) {
+            if (next[k] < 0 || (open >> k & 1)) continue;
+            closed[closed_count++] = k;
+            if (mzdegree(maze, next[k]) == 1) dead[dead_count++] = k;
+        }
+        if (dead_count > 0) mzlink(maze, c, dead[mrand() % dead_count], false);
+        else if (closed_count > 0) mzlink(maze, c, closed[mrand() % closed_count], false);
+    }
+}
+
+// Fills dead ends back in, up to passes layers deep (passes <= 0 removes
+// every dead end). Each layer only revisits the cells freed by the one
+// before, so the cost is one sweep plus the number of removed cells.
+void xmmaze_prune(const MazeGraph maze, const int passes) {
+    const int cells = maze.w * maze.h;
+    int* frontier = toss(int, cells);
+    int count = 0;
+    for (int c = 0; c < cells; c++)
+        if (mzdegree(maze, c) == 1) frontier[count++] = c;
+
+    for (int pass = 0; count > 0 && (passes <= 0 || pass < passes); pass++) {
+        int next_count = 0;
+        for (int f = 0; f < count; f++) {
+            const int c = frontier[f];
+            const int open = mzopen(maze, c);
+            if (open == 0) continue;
+            int dir = 0;
+            while (!(open >> dir & 1)) dir++;
+            int next[4];
+            mzneighbors(maze, c, next);
+            mzlink(maze, c, dir, true);
+            // The neighbour is queued for the next layer; the write position
+            // never overtakes f because at most one cell is queued per cell.
+            if (mzdegree(maze, next[dir]) == 1) frontier[next_count++] = next[dir];
+        }
+        count = next_count;
+    }
+    mfree(frontier);
+}
 
-            int nx = cx + dx[chosen_dir];
-            int ny = cy + dy[chosen_dir];
-            int wx = cx + wall_dx[chosen_dir];
-            int wy = cy + wall_dy[chosen_dir];
+// Expands the cell window [cx, cx + cw) x [cy, cy + ch) into tiles starting
+// at the map origin: cells land on odd coordinates and passages between
+// them on even ones. Cells without any passage stay '#'.
+void xmmaze_blit(const MazeGraph maze, const Map map, const int cx, const int cy, const int cw, const int ch) {
+    const int tw = 2 * cw + 1 < map.w ? 2 * cw + 1 : map.w;
+    const int th = 2 * ch + 1 < map.h ? 2 * ch + 1 : map.h;
+    for (int y = 0; y < th; y++)
+        memset(map.walling[y], '#', tw);
+
+    for (int j = 0; j < ch; j++) {
+        const int my = cy + j;
+        if (my < 0 || my >= maze.h) continue;
+        for (int i = 0; i < cw; i++) {
+            const int mx = cx + i;
+            if (mx < 0 || mx >= maze.w) continue;
+            const int c = my * maze.w + mx;
+            const int open = mzopen(maze, c);
+            const int tx = 2 * i + 1;
+            const int ty = 2 * j + 1;
+            if (open == 0 && maze.w * maze.h > 1) continue;
+            if (ty < th && tx < tw) map.walling[ty][tx] = ' ';
+            if ((open & 2) && ty < th && tx + 1 < tw) map.walling[ty][tx + 1] = ' ';
+            if ((open & 4) && ty + 1 < th && tx < tw) map.walling[ty + 1][tx] = ' ';
+            if ((open & 8) && i == 0 && ty < th) map.walling[ty][0] = ' ';
+            if ((open & 1) && j == 0 && tx < tw) map.walling[0][tx] = ' ';
+        }
+    }
+}
 
-            map.walling[wy][wx] = ' ';
-            map.walling[ny][nx] = ' ';
+Map xmmaze_expand(const MazeGraph maze) {
+    Map map = mnew(2 * maze.h + 1, 2 * maze.w + 1);
+    xmmaze_blit(maze, map, 0, 0, maze.w, maze.h);
+    return map;
+}
 
-            stack_x[stack_top] = nx;
-            stack_y[stack_top] = ny;
-            stack_top++;
+/* ---------------------------- Maze generators ---------------------------- */
 
-        } else {
-            stack_top--;
+// Recursive backtracker over the odd cells of a maze_w x maze_h area.
+// Every cell whose tile is still '#' becomes a seed, so regions cut off by
+// rooms get their own maze. Cells are tracked on a (maze_w/2) x (maze_h/2)
+// parity grid and all seeds share one stack of packed cell indices, which
+// makes the whole fill a single allocation and linear in the cell count.
+// With a region grid each seed's maze is labelled next_region, next_region
+// + 1, ...; the first unused label is returned.
+static int maze_backtrack(const Map map, const int maze_w, const int maze_h, const char floor, int* region, int next_region) {
+    const int cw = (maze_w - 1) / 2;
+    const int ch = (maze_h - 1) / 2;
+    const int cells = cw * ch;
+    if (cells <= 0) return next_region;
+
+    int* stack = (int*)mmalloc(cells * sizeof(int) + cells);
+    unsigned char* visited = (unsigned char*)(stack + cells);
+    for (int j = 0; j < ch; j++)
+        for (int i = 0; i < cw; i++)
+            visited[j * cw + i] = map.walling[2 * j + 1][2 * i + 1] != '#';
+
+    const int step[] = {-cw, 1, cw, -1};
+    const int wall_dx[] = {0, 1, 0, -1};
+    const int wall_dy[] = {-1, 0, 1, 0};
+
+    for (int seed = 0; seed < cells; seed++) {
+        if (visited[seed]) continue;
+        const int id = next_region++;
+        int stack_top = 0;
+        stack[stack_top++] = seed;
+        visited[seed] = 1;
+        map.walling[2 * (seed / cw) + 1][2 * (seed % cw) + 1] = floor;
+        if (region) region[(2 * (seed / cw) + 1) * map.w + 2 * (seed % cw) + 1] = id;
+
+        while (stack_top > 0) {
+            const int c = stack[stack_top - 1];
+            const int ci = c % cw;
+            const int cj = c / cw;
+
+            int valid_neighbors[4];
+            int neighbor_count = 0;
+            if (cj > 0      && !visited[c - cw]) valid_neighbors[neighbor_count++] = 0;
+            if (ci < cw - 1 && !visited[c + 1])  valid_neighbors[neighbor_count++] = 1;
+            if (cj < ch - 1 && !visited[c + cw]) valid_neighbors[neighbor_count++] = 2;
+            if (ci > 0      && !visited[c - 1])  valid_neighbors[neighbor_count++] = 3;
+
+            if (neighbor_count > 0) {
+                const int chosen_dir = valid_neighbors[mrand() % neighbor_count];
+                const int n = c + step[chosen_dir];
+                const int wx = 2 * ci + 1 + wall_dx[chosen_dir];
+                const int wy = 2 * cj + 1 + wall_dy[chosen_dir];
+                const int nx = 2 * (n % cw) + 1;
+                const int ny = 2 * (n / cw) + 1;
+                visited[n] = 1;
+                map.walling[wy][wx] = floor;
+                map.walling[ny][nx] = floor;
+                if (region) region[wy * map.w + wx] = region[ny * map.w + nx] = id;
+                stack[stack_top++] = n;
+            } else {
+                stack_top--;
+            }
         }
     }
+    mfree(stack);
+    return next_region;
+}
+
+Map xmgen_maze(const int wR, const int hR, const int w, const int h) {
+    MAP_BEGIN("xmgen_maze");
+    int maze_w = (w % 2 == 0) ? w + 1 : w;
+    if (maze_w < 3) maze_w = 3;
+    int maze_h = (h % 2 == 0) ? h + 1 : h;
+    if (maze_h < 3) maze_h = 3;
+
+    mseed();
+    Map map = mnew(hR, wR);
+
+    MazeGraph maze = xmmaze_new((maze_w - 1) / 2, (maze_h - 1) / 2);
+    xmmaze_carve(maze);
+    xmmaze_blit(maze, map, 0, 0, maze.w, maze.h);
+    xmmaze_free(maze);
 
     map.walling[1][0] = ' ';
     map.walling[maze_h - 2][maze_w - 1] = ' ';
-    printf("Map");
-    free(stack_x);
-    free(stack_y);
 
+    MAP_END();
     return map;
 }
 
-Map xmgen_room_maze(const int wR, const int hR, const int w, const int h, const int num_rooms_to_try, const int min_room_size, const int max_room_size) {
+// Eller's algorithm: the maze is produced one row at a time and only the
+// set labels of the current row are kept, so memory is O(w) no matter how
+// many rows are emitted. Set labels stay compact in [0, cw) and are merged
+// through a per-row union-find, which keeps every row linear in w.
+// Coin flips for Eller come 15 at a time out of one mrand() call.
+static int eller_coin(unsigned* pool, int* avail) {
+    if (*avail == 0) {
+        *pool = (unsigned)mrand();
+        *avail = 15;
+    }
+    const int bit = *pool & 1;
+    *pool >>= 1;
+    (*avail)--;
+    return bit;
+}
+
+int xmgen_maze_stream(const int w, const int rows, MapRowCallback emit, void* user) {
+    MAP_BEGIN("xmgen_maze_stream");
+    int maze_w = (w % 2 == 0) ? w + 1 : w;
+    if (maze_w < 3) maze_w = 3;
+    const int cw = (maze_w - 1) / 2;
+
+    mseed();
+
+    int* set = toss(int, 4 * cw);
+    int* parent = set + cw;
+    int* count = parent + cw;
+    int* remap = count + cw;
+    char* down = toss(char, cw);
+    char* line = toss(char, maze_w);
+
+    for (int i = 0; i < cw; i++) set[i] = i;
+
+    unsigned pool = 0;
+    int avail = 0;
+    int y = 0;
+    memset(line, '#', maze_w);
+    bool running = emit(line, y++, maze_w, user);
+
+    for (int r = 0; running && (rows <= 0 || r < rows); r++) {
+        const bool last = rows > 0 && r == rows - 1;
+
+        // Cell row: join neighbouring cells of different sets at random.
+        for (int i = 0; i < cw; i++) parent[i] = i;
+        line[0] = r == 0 ? ' ' : '#';
+        for (int i = 0; i < cw; i++) {
+            line[2 * i + 1] = ' ';
+            line[2 * i + 2] = '#';
+        }
+        int a = uf_find(parent, set[0]);
+        for (int i = 0; i < cw - 1; i++) {
+            const int b = uf_find(parent, set[i + 1]);
+            const int join = (a != b) & (eller_coin(&pool, &avail) | last);
+            parent[b] = join ? a : b;
+            line[2 * i + 2] = join ? ' ' : '#';
+            a = join ? a : b;
+        }
+        for (int i = 0; i < cw; i++) set[i] = uf_find(parent, set[i]);
+        if (last) line[maze_w - 1] = ' ';
+        running = emit(line, y++, maze_w, user);
+        if (!running || last) break;
+
+        // Wall row: every set must carry at least one passage downwards.
+        for (int i = 0; i < cw; i++) count[i] = 0;
+        for (int i = 0; i < cw; i++) count[set[i]]++;
+        for (int i = 0; i < cw; i++) remap[i] = 0;
+        memset(line, '#', maze_w);
+        for (int i = 0; i < cw; i++) {
+            const int l = set[i];
+            const int force = --count[l] == 0 && !remap[l];
+            down[i] = (char)(eller_coin(&pool, &avail) | force);
+            remap[l] |= down[i];
+            line[2 * i + 1] = down[i] ? ' ' : '#';
+        }
+        running = emit(line, y++, maze_w, user);
+
+        // Relabel: carried cells keep one label per set, new cells get fresh ones.
+        for (int i = 0; i < cw; i++) remap[i] = -1;
+        int next = 0;
+        for (int i = 0; i < cw; i++) {
+            const int l = set[i];
+            const int carried = remap[l];
+            const int fresh = !down[i] || carried < 0;
+            set[i] = fresh ? next : carried;
+            remap[l] = down[i] ? set[i] : carried;
+            next += fresh;
+        }
+    }
+
+    if (running && rows > 0) {
+        memset(line, '#', maze_w);
+        emit(line, y++, maze_w, user);
+    }
+
+    mfree(line);
+    mfree(down);
+    mfree(set);
+    MAP_END();
+    return y;
+}
+
+// Rooms and mazes (stuffwithstuff): one in this many redundant connectors
+// is opened anyway so the dungeon gets a few loops.
+#define ROOM_MAZE_EXTRA_CONNECTOR 50
+
+// Room links for MapInfo. doors holds (tile, region, region) triples; rooms
+// are regions 1..room_count. Doors still standing after pruning join maze
+// regions into networks, and the rooms opening onto one network are
+// chained in door order; a door between two rooms links them directly.
+static void room_maze_links(MapInfo* info, const Map map, int* doors, const int door_count, const int room_count, const int region_count) {
+    int* parent = toss(int, region_count);
+    int* last = toss(int, region_count);
+    for (int i = 0; i < region_count; i++) {
+        parent[i] = i;
+        last[i] = -1;
+    }
+    for (int d = 0; d < door_count; d++) {
+        const int a = doors[3 * d + 1];
+        const int b = doors[3 * d + 2];
+        if (a > room_count && b > room_count) parent[uf_find(parent, b)] = uf_find(parent, a);
+    }
+    for (int d = 0; d < door_count; d++) {
+        const int i = doors[3 * d];
+        const int x = i % map.w;
+        const int y = i / map.w;
+        if (map.walling[y][x] != '+') continue;
+        int a = doors[3 * d + 1];
+        int b = doors[3 * d + 2];
+        if (a <= room_count && b <= room_count) {
+            info_corridor(info, a - 1, b - 1, x, y, x, y);
+            continue;
+        }
+        if (a > room_count) {
+            const int t = a;
+            a = b;
+            b = t;
+        }
+        if (a > room_count) continue;
+        const int net = uf_find(parent, b);
+        if (last[net] >= 0) {
+            const int prev = doors[3 * last[net]];
+            const int room = doors[3 * last[net] + 1] <= room_count ? doors[3 * last[net] + 1] : doors[3 * last[net] + 2];
+            if (room != a) info_corridor(info, room - 1, a - 1, prev % map.w, prev / map.w, x, y);
+        }
+        last[net] = d;
+    }
+    mfree(last);
+    mfree(parent);
+}
+
+Map xmgen_room_maze(const int wR, const int hR, const int w, const int h, const int num_rooms_to_try, const int min_room_size, const int max_room_size, MapInfo* info) {
+    MAP_BEGIN("xmgen_room_maze");
     int maze_w = (w % 2 == 0) ? w + 1 : w;
     if (maze_w < 15) maze_w = 15;
     int maze_h = (h % 2 == 0) ? h + 1 : h;
     if (maze_h < 15) maze_h = 15;
 
-    //srand((unsigned)time(0));
     Map map = mnew(hR, wR);
+    if (info) zero(*info);
 
     Rect* rooms = toss(Rect, num_rooms_to_try);
     int room_count_local = 0;
 
+    MAP_BEGIN("place rooms");
     for (int i = 0; i < num_rooms_to_try && room_count_local < num_rooms_to_try; i++) {
-        int rw = min_room_size + (rand() % (max_room_size - min_room_size + 1));
+        int rw = min_room_size + (mrand() % (max_room_size - min_room_size + 1));
         if (rw % 2 == 0) rw++;
-        int rh = min_room_size + (rand() % (max_room_size - min_room_size + 1));
+        int rh = min_room_size + (mrand() % (max_room_size - min_room_size + 1));
         if (rh % 2 == 0) rh++;
 
-        int rx = (rand() % ((maze_w - rw - 2) / 2 + ((maze_w - rw - 2) / 2==0))) * 2 + 1;
-        int ry = (rand() % ((maze_h - rh - 2) / 2 + ((maze_h - rh - 2) / 2==0))) * 2 + 1;
+        int rx = (mrand() % ((maze_w - rw - 2) / 2 + ((maze_w - rw - 2) / 2==0))) * 2 + 1;
+        int ry = (mrand() % ((maze_h - rh - 2) / 2 + ((maze_h - rh - 2) / 2==0))) * 2 + 1;
 
         Rect new_room = {rx, ry, rw, rh};
 
@@ -1124,89 +2361,89 @@ Map xmgen_room_maze(const int wR, const int hR, const int w, const int h, const
             rooms[room_count_local++] = new_room;
         }
     }
+    MAP_END();
 
+    // Region ids per tile: rooms are 1..room_count, every maze gets its own.
+    int* region = (int*)mcalloc(map.w * map.h, sizeof(int));
     for (int i = 0; i < room_count_local; i++) {
         Rect r = rooms[i];
         for (int y = r.y; y < r.y + r.h; y++) {
             for (int x = r.x; x < r.x + r.w; x++) {
                 map.walling[y][x] = ' ';
+                region[y * map.w + x] = i + 1;
             }
         }
     }
 
-    for (int y = 1; y < maze_h; y += 2) {
-        for (int x = 1; x < maze_w; x += 2) {
-            if (map.walling[y][x] == '#') {
-                int* stack_x = toss(int, maze_w * maze_h);
-                int* stack_y = toss(int, maze_w * maze_h);
-                int stack_top = 0;
-
-                stack_x[stack_top] = x;
-                stack_y[stack_top] = y;
-                stack_top++;
-                map.walling[y][x] = '.';
-
-                int dx[] = {0, 2, 0, -2};
-                int dy[] = {-2, 0, 2, 0};
-                int wall_dx[] = {0, 1, 0, -1};
-                int wall_dy[] = {-1, 0, 1, 0};
-
-                while (stack_top > 0) {
-                    int cx = stack_x[stack_top - 1];
-                    int cy = stack_y[stack_top - 1];
-
-                    int valid_neighbors[4];
-                    int neighbor_count = 0;
-                    for (int k = 0; k < 4; k++) {
-                        int nx = cx + dx[k];
-                        int ny = cy + dy[k];
-                        if (nx > 0 && nx < maze_w - 1 && ny > 0 && ny < maze_h - 1 && map.walling[ny][nx] == '#') {
-                            valid_neighbors[neighbor_count++] = k;
-                        }
-                    }
-
-                    if (neighbor_count > 0) {
-                        int rand_idx = rand() % neighbor_count;
-                        int chosen_dir = valid_neighbors[rand_idx];
-                        int nx = cx + dx[chosen_dir];
-                        int ny = cy + dy[chosen_dir];
-                        int wx = cx + wall_dx[chosen_dir];
-                        int wy = cy + wall_dy[chosen_dir];
-
-                        map.walling[wy][wx] = '.';
-                        map.walling[ny][nx] = '.';
-
-                        stack_x[stack_top] = nx;
-                        stack_y[stack_top] = ny;
-                        stack_top++;
-                    } else {
-                        stack_top--;
-                    }
-                }
-                free(stack_x);
-                free(stack_y);
+    MAP_BEGIN("maze");
+    const int region_count = maze_backtrack(map, maze_w, maze_h, '.', region, room_count_local + 1);
+    MAP_END();
+
+    // Connectors are walls with two different regions on opposite sides.
+    MAP_BEGIN("connect");
+    const int tiles = maze_w * maze_h;
+    int* connector = toss(int, 3 * tiles);
+    int connector_count = 0;
+    for (int y = 1; y < maze_h - 1; y++) {
+        for (int x = 1; x < maze_w - 1; x++) {
+            if (map.walling[y][x] != '#') continue;
+            const int i = y * map.w + x;
+            int a = region[i - 1];
+            int b = region[i + 1];
+            if (!a || !b || a == b) {
+                a = region[i - map.w];
+                b = region[i + map.w];
+            }
+            if (a && b && a != b) {
+                connector[3 * connector_count] = i;
+                connector[3 * connector_count + 1] = a;
+                connector[3 * connector_count + 2] = b;
+                connector_count++;
             }
         }
     }
 
-    for (int i = 0; i < room_count_local; i++) {
-        Rect r = rooms[i];
-        Point doors[r.w * 2 + r.h * 2];
-        int door_count = 0;
-
-        for (int x = r.x; x < r.x + r.w; x++) {
-            if (r.y - 2 > 0 && map.walling[r.y - 2][x] == '.') doors[door_count++] = (Point){(float)x, (float)r.y - 1};
-            if (r.y + r.h + 1 < maze_h && map.walling[r.y + r.h + 1][x] == '.') doors[door_count++] = (Point){(float)x, (float)r.y + r.h};
-        }
-        for (int y = r.y; y < r.y + r.h; y++) {
-            if (r.x - 2 > 0 && map.walling[y][r.x - 2] == '.') doors[door_count++] = (Point){(float)r.x - 1, (float)y};
-            if (r.x + r.w + 1 < maze_w && map.walling[y][r.x + r.w + 1] == '.') doors[door_count++] = (Point){(float)r.x + r.w, (float)y};
+    // Kruskal in random order: a connector becomes a door when it joins two
+    // regions that are still apart, and occasionally when it does not.
+    int* parent = toss(int, region_count);
+    for (int i = 0; i < region_count; i++) parent[i] = i;
+    int door_count = 0;
+    for (int c = connector_count - 1; c > 0; c--) {
+        const int s = mrand() % (c + 1);
+        for (int k = 0; k < 3; k++) {
+            const int temp = connector[3 * c + k];
+            connector[3 * c + k] = connector[3 * s + k];
+            connector[3 * s + k] = temp;
         }
-
-        if (door_count > 0) {
-            Point door = doors[rand() % door_count];
-            map.walling[(int)door.y][(int)door.x] = '+';
+    }
+    for (int c = 0; c < connector_count; c++) {
+        const int i = connector[3 * c];
+        const int x = i % map.w;
+        const int y = i / map.w;
+        const int ra = uf_find(parent, connector[3 * c + 1]);
+        const int rb = uf_find(parent, connector[3 * c + 2]);
+        if (ra != rb) {
+            parent[rb] = ra;
+            map.walling[y][x] = '+';
+        } else if (mrand() % ROOM_MAZE_EXTRA_CONNECTOR == 0 &&
+                   map.walling[y][x - 1] != '+' && map.walling[y][x + 1] != '+' &&
+                   map.walling[y - 1][x] != '+' && map.walling[y + 1][x] != '+') {
+            map.walling[y][x] = '+';
+        } else {
+            continue;
         }
+        // Doors are compacted to the front; slot c has already been read.
+        for (int k = 0; k < 3; k++) connector[3 * door_count + k] = connector[3 * c + k];
+        door_count++;
+    }
+    MAP_END();
+    mfree(parent);
+    mfree(region);
+
+    int* doors = NULL;
+    if (info) {
+        doors = toss(int, 3 * door_count + 1);
+        memcpy(doors, connector, 3 * door_count * sizeof(int));
     }
 
     for (int y = 0; y < maze_h; y++) {
@@ -1217,9 +2454,46 @@ Map xmgen_room_maze(const int wR, const int hR, const int w, const int h, const
         }
     }
 
-    connect_rooms(map, rooms, room_count_local);
+    // Dead-end pruning: a tile is queued when it first drops to one exit,
+    // so every tile is handled at most once.
+    MAP_BEGIN("prune");
+    if (room_count_local > 0) {
+        int* dead = connector;
+        int dead_count = 0;
+        for (int y = 1; y < maze_h - 1; y++)
+            for (int x = 1; x < maze_w - 1; x++)
+                if (map.walling[y][x] != '#' && floor_exits(map, x, y) <= 1)
+                    dead[dead_count++] = y * map.w + x;
+
+        const int dx[] = {0, 1, 0, -1};
+        const int dy[] = {-1, 0, 1, 0};
+        while (dead_count > 0) {
+            const int i = dead[--dead_count];
+            const int x = i % map.w;
+            const int y = i / map.w;
+            map.walling[y][x] = '#';
+            for (int k = 0; k < 4; k++) {
+                const int nx = x + dx[k];
+                const int ny = y + dy[k];
+                if (nx < 1 || ny < 1 || nx >= maze_w - 1 || ny >= maze_h - 1) continue;
+                if (map.walling[ny][nx] != '#' && floor_exits(map, nx, ny) == 1)
+                    dead[dead_count++] = ny * map.w + nx;
+            }
+        }
+    }
+    MAP_END();
+    mfree(connector);
+
+    if (info) {
+        for (int i = 0; i < room_count_local; i++) info_room(info, rooms[i]);
+        info_ring_doors(info, map);
+        room_maze_links(info, map, doors, door_count, room_count_local, region_count);
+        info_finish(info);
+        mfree(doors);
+    }
 
-    free(rooms);
+    mfree(rooms);
+    MAP_END();
     return map;
 }
 
@@ -1243,14 +2517,16 @@ static int is_connected(Map map, Point start, Point end) {
 
     stack[stack_top++] = start;
     visited[(int)start.y][(int)start.x] = 1;
+    MAP_STAT(floods, 1);
 
     while (stack_top > 0) {
         Point current = stack[--stack_top];
+        MAP_STAT(cells_visited, 1);
 
         if ((int)current.x == (int)end.x && (int)current.y == (int)end.y) {
-            for (int y = 0; y < map.h; y++) free(visited[y]);
-            free(visited);
-            free(stack);
+            for (int y = 0; y < map.h; y++) mfree(visited[y]);
+            mfree(visited);
+            mfree(stack);
             return 1;
         }
 
@@ -1266,9 +2542,9 @@ static int is_connected(Map map, Point start, Point end) {
         }
     }
 
-    for (int y = 0; y < map.h; y++) free(visited[y]);
-    free(visited);
-    free(stack);
+    for (int y = 0; y < map.h; y++) mfree(visited[y]);
+    mfree(visited);
+    mfree(stack);
     return 0;
 }
 
@@ -1339,7 +2615,8 @@ void xmgen_add_enviroment(Map* map, char tile, int x, int y,  int w, int h, floa
 /* -------------------------- Drunk & Cellular & Perlin -------------------- */
 
 Map xmgen_drunk(const int w, const int h, const float floor_goal_percent) {
-    srand((unsigned)time(0));
+    mseed();
+    MAP_BEGIN("xmgen_drunk");
     Map map = mnew(h, w);
     int floor_count = 0;
     const int total_tiles = w * h;
@@ -1353,7 +2630,7 @@ Map xmgen_drunk(const int w, const int h, const float floor_goal_percent) {
             map.walling[walker_y][walker_x] = ' ';
             floor_count++;
         }
-        int move = rand() % 4;
+        int move = mrand() % 4;
         switch (move) {
         case 0: walker_y--; break;
         case 1: walker_y++; break;
@@ -1367,6 +2644,7 @@ Map xmgen_drunk(const int w, const int h, const float floor_goal_percent) {
         iterations++;
     }
     //xmgen_add_enviroment(&map, '"', 0, 0, w, h, 0.5);
+    MAP_END();
     return map;
 }
 
@@ -1374,13 +2652,15 @@ Map xmgen_drunk(const int w, const int h, const float floor_goal_percent) {
 
 /* ----------------------------- xmgen_brogue ------------------------------ */
 
-Map xmgen_brogue(const int w, const int h, const int max_rooms, const int min_size, const int max_size) {
-    srand((unsigned)time(0));
+Map xmgen_brogue(const int w, const int h, const int max_rooms, const int min_size, const int max_size, MapInfo* info) {
+    mseed();
+    MAP_BEGIN("xmgen_brogue");
     Map map; //= mnew(h, w);
     int isGen = false;
     
     while(!isGen){
     map = mnew(h, w);
+    if (info) zero(*info);
     
 
     Rect* rooms = toss(Rect, max_rooms);
@@ -1399,18 +2679,23 @@ Map xmgen_brogue(const int w, const int h, const int max_rooms, const int min_si
         }
     }
     rooms[room_count_local++] = (Rect){start_x, start_y, first_room.w, first_room.h};
+    info_room(info, rooms[0]);
 
-    for(int y=0; y<first_room.h; y++) free(first_room.tiles[y]); free(first_room.tiles);
+    mfree(first_room.tiles);
 
     int rooms_placed = 1;
     int attempts = 0;
 
+    MAP_BEGIN("place rooms");
     while (rooms_placed < max_rooms && attempts < 20000) {
         attempts++;
+        MAP_BEGIN("room shape");
         BrogueRoom new_room = create_brogue_room(min_size, max_size);
+        MAP_END();
 
         Point* perimeter = toss(Point, w * h);
         int perimeter_count = 0;
+        MAP_STAT(cells_visited, (w - 2) * (h - 2));
         for (int y = 1; y < h - 1; y++) {
             for (int x = 1; x < w - 1; x++) {
                 //printf("%d %d\n", x, y);
@@ -1424,14 +2709,14 @@ Map xmgen_brogue(const int w, const int h, const int max_rooms, const int min_si
         }
 
         if (perimeter_count == 0) {
-            free(perimeter);
-            for(int y=0; y<new_room.h; y++) free(new_room.tiles[y]); free(new_room.tiles);
+            mfree(perimeter);
+            mfree(new_room.tiles);
             break;
         }
 
         bool placed = false;
         for (int p_idx = 0; p_idx < perimeter_count; p_idx++) {
-            int rand_idx = p_idx + rand() % (perimeter_count - p_idx);
+            int rand_idx = p_idx + mrand() % (perimeter_count - p_idx);
             Point temp = perimeter[p_idx]; perimeter[p_idx] = perimeter[rand_idx]; perimeter[rand_idx] = temp;
         }
 
@@ -1457,6 +2742,16 @@ Map xmgen_brogue(const int w, const int h, const int max_rooms, const int min_si
                 }
 
                 if (!overlap) {
+                    // The room this one hangs off, found before it is carved.
+                    int owner = -1;
+                    if (info) {
+                        const int ax = (int)attach_point.x;
+                        const int ay = (int)attach_point.y;
+                        const int nx[4] = { ax, ax, ax - 1, ax + 1 };
+                        const int ny[4] = { ay - 1, ay + 1, ay, ay };
+                        for (int k = 0; k < 4 && owner < 0; k++)
+                            if (map.walling[ny[k]][nx[k]] == ' ') owner = info_room_at(info, nx[k], ny[k]);
+                    }
                     int placed_room_x = place_x;
                     int placed_room_y = place_y;
                     int placed_room_w = new_room.w;
@@ -1473,10 +2768,14 @@ Map xmgen_brogue(const int w, const int h, const int max_rooms, const int min_si
                     map.walling[(int)attach_point.y][(int)attach_point.x] = ' ';
 
                     rooms[room_count_local++] = (Rect){placed_room_x, placed_room_y, placed_room_w, placed_room_h};
+                    info_room(info, rooms[room_count_local - 1]);
+                    info_door(info, (int)attach_point.x, (int)attach_point.y, room_count_local - 1);
+                    info_corridor(info, owner, room_count_local - 1, (int)attach_point.x, (int)attach_point.y, (int)attach_point.x, (int)attach_point.y);
 
                     Point room_center = { (float)(placed_room_x + placed_room_w/2), (float)(placed_room_y + placed_room_h/2) };
                     Point main_center = { w/2.0f, h/2.0f };
 
+                    MAP_BEGIN("connect");
                     if (!is_connected(map, room_center, main_center)) {
                         Point room_point = { -1, -1 };
                         Point map_point = { -1, -1 };
@@ -1509,8 +2808,12 @@ Map xmgen_brogue(const int w, const int h, const int max_rooms, const int min_si
 
                         if (min_dist >= 0.0f) {
                             create_corridor(map, (int)room_point.x, (int)room_point.y, (int)map_point.x, (int)map_point.y);
+                            if (info)
+                                info_corridor(info, room_count_local - 1, info_room_at(info, (int)map_point.x, (int)map_point.y),
+                                              (int)room_point.x, (int)room_point.y, (int)map_point.x, (int)map_point.y);
                         }
                     }
+                    MAP_END();
 
                     placed = true;
                     rooms_placed++;
@@ -1519,9 +2822,11 @@ Map xmgen_brogue(const int w, const int h, const int max_rooms, const int min_si
             }
         }
 
-        free(perimeter);
-        for(int y=0; y<new_room.h; y++) free(new_room.tiles[y]); free(new_room.tiles);
+        if (!placed) MAP_STAT(rejected, 1);
+        mfree(perimeter);
+        mfree(new_room.tiles);
     }
+    MAP_END();
     int wallCount = 0;
     for(int y = 0; y < map.h; y++){
         for(int x = 0; x < map.w; x++){
@@ -1532,16 +2837,19 @@ Map xmgen_brogue(const int w, const int h, const int max_rooms, const int min_si
     }
     if(wallCount == (map.h*map.w)){
         xmclose(map);
-        free(rooms);
+        mfree(rooms);
+        if (info) xminfo_free(info);
         isGen = false;
         //return xmgen_brogue(w, h, max_rooms, min_size, max_size);
     }
     else{
         isGen = true;
-        connect_rooms(map, rooms, room_count_local);
-        free(rooms);    
+        connect_rooms(map, rooms, room_count_local, info);
+        info_finish(info);
+        mfree(rooms);    
     }
 }
+    MAP_END();
     return map;
 }
 
@@ -1572,8 +2880,27 @@ void bsp_corridor(Map map, int x1, int y1, int x2, int y2) {
     }
 }
 
-void partition(Map map, Rect area, int min_size) {
-    bool split_horizontally = (rand() % 2 == 0);
+// Room of info->rooms[from, to) holding (x, y), else the one whose centre
+// is nearest; -1 for an empty range.
+static int bsp_room_near(const MapInfo* info, const int from, const int to, const int x, const int y) {
+    int best = -1;
+    int best_d2 = 0;
+    for (int i = from; i < to; i++) {
+        const Rect r = info->rooms[i];
+        if (x >= r.x && x < r.x + r.w && y >= r.y && y < r.y + r.h) return i;
+        int cx, cy;
+        room_center(r, &cx, &cy);
+        const int d2 = (cx - x) * (cx - x) + (cy - y) * (cy - y);
+        if (best < 0 || d2 < best_d2) {
+            best = i;
+            best_d2 = d2;
+        }
+    }
+    return best;
+}
+
+void partition(Map map, Rect area, int min_size, MapInfo* info) {
+    bool split_horizontally = (mrand() % 2 == 0);
     
     if (area.w > area.h * 1.25) split_horizontally = false;
     else if (area.h > area.w * 1.25) split_horizontally = true;
@@ -1582,16 +2909,17 @@ void partition(Map map, Rect area, int min_size) {
 
     if (max_split <= min_size) {
         // Create a room slightly smaller than the partitioned area
-        int rw = (rand() % (area.w - 4)) + 3; // min width 3
-        int rh = (rand() % (area.h - 4)) + 3; // min height 3
-        int rx = area.x + (rand() % (area.w - rw - 1)) + 1;
-        int ry = area.y + (rand() % (area.h - rh - 1)) + 1;
+        int rw = (mrand() % (area.w - 4)) + 3; // min width 3
+        int rh = (mrand() % (area.h - 4)) + 3; // min height 3
+        int rx = area.x + (mrand() % (area.w - rw - 1)) + 1;
+        int ry = area.y + (mrand() % (area.h - rh - 1)) + 1;
         
         fill_rect(map, (Rect){rx, ry, rw, rh}, ' ');
+        info_room(info, (Rect){rx, ry, rw, rh});
         return;
     }
 
-    int split = (rand() % (max_split - min_size)) + min_size;
+    int split = (mrand() % (max_split - min_size)) + min_size;
 
     Rect r1, r2;
     if (split_horizontally) {
@@ -1602,40 +2930,59 @@ void partition(Map map, Rect area, int min_size) {
         r2 = (Rect){area.x + split, area.y, area.w - split, area.h};
     }
 
-    partition(map, r1, min_size);
+    const int first = info ? info->room_count : 0;
+    partition(map, r1, min_size, info);
+    const int mid = info ? info->room_count : 0;
     create_corridor(map, r1.x + r1.w / 2 - 1, r1.y + r1.h / 2, r2.x + r2.w / 2, r2.y + r2.h / 2);
-    partition(map, r2, min_size);
+    partition(map, r2, min_size, info);
     create_corridor(map, r1.x + r1.w / 2, r1.y + r1.h / 2, r2.x + r2.w / 2, r2.y + r2.h / 2);
+    if (info) {
+        const int last = info->room_count;
+        const int ax = r1.x + r1.w / 2, ay = r1.y + r1.h / 2;
+        const int bx = r2.x + r2.w / 2, by = r2.y + r2.h / 2;
+        info_corridor(info, bsp_room_near(info, first, mid, ax - 1, ay), bsp_room_near(info, mid, last, bx, by), ax - 1, ay, bx, by);
+        info_corridor(info, bsp_room_near(info, first, mid, ax, ay), bsp_room_near(info, mid, last, bx, by), ax, ay, bx, by);
+    }
     //bsp_corridor(map, r1.x + r1.w / 2, r1.y + r1.h / 2, r2.x + r2.w / 2, r2.y + r2.h / 2);
 }
 
-Map xmgen_bsp(const int w, const int h, const int min_room_size) {
+Map xmgen_bsp(const int w, const int h, const int min_room_size, MapInfo* info) {
+    MAP_BEGIN("xmgen_bsp");
     Map map = mnew(h, w); // Uses your mnew helper from Map.h
+    if (info) zero(*info);
     for (int y = 0; y < h; y++) {
         for (int x = 0; x < w; x++) {
             map.walling[y][x] = '#';
         }
     }
 Rect root = {1, 1, w - 2, h - 2};
-    partition(map, root, min_room_size + 2);
+    MAP_BEGIN("partition");
+    partition(map, root, min_room_size + 2, info);
+    MAP_END();
+    info_ring_doors(info, map);
+    info_finish(info);
 
+    MAP_END();
     return map;
 }
 
-Map xmgen_scatter(int w, int h, int room_count, int min_sz, int max_sz) {
+Map xmgen_scatter(int w, int h, int room_count, int min_sz, int max_sz, MapInfo* info) {
+    MAP_BEGIN("xmgen_scatter");
     Map map = mnew(h, w);
+    if (info) zero(*info);
     
     for(int y=0; y<h; y++) for(int x=0; x<w; x++) map.walling[y][x] = '#';
 
     typedef struct { int x, y, w, h, cx, cy; } Room;
     Room* rooms = toss(Room, room_count);
     int placed = 0;
+    MAP_BEGIN("place rooms");
 
     for (int i = 0; i < room_count; i++) {
-        int rw = (rand() % (max_sz - min_sz)) + min_sz;
-        int rh = (rand() % (max_sz - min_sz)) + min_sz;
-        int rx = (rand() % (w - rw - 2)) + 1;
-        int ry = (rand() % (h - rh - 2)) + 1;
+        int rw = (mrand() % (max_sz - min_sz)) + min_sz;
+        int rh = (mrand() % (max_sz - min_sz)) + min_sz;
+        int rx = (mrand() % (w - rw - 2)) + 1;
+        int ry = (mrand() % (h - rh - 2)) + 1;
 
     
         bool overlap = false;
@@ -1647,7 +2994,8 @@ Map xmgen_scatter(int w, int h, int room_count, int min_sz, int max_sz) {
             }
         }
 
-        if (!overlap) {
+        if (overlap) MAP_STAT(rejected, 1);
+        else {
     
             for (int y = ry; y < ry + rh; y++) {
                 for (int x = rx; x < rx + rw; x++) {
@@ -1655,12 +3003,14 @@ Map xmgen_scatter(int w, int h, int room_count, int min_sz, int max_sz) {
                 }
             }
             rooms[placed] = (Room){rx, ry, rw, rh, rx + rw/2, ry + rh/2};
+            info_room(info, (Rect){rx, ry, rw, rh});
             
     
             if (placed > 0) {
     
                 int prev_cx = rooms[placed-1].cx;
                 int prev_cy = rooms[placed-1].cy;
+                info_corridor(info, placed - 1, placed, prev_cx, prev_cy, rooms[placed].cx, rooms[placed].cy);
                 
     
                 int x = prev_cx;
@@ -1677,8 +3027,12 @@ Map xmgen_scatter(int w, int h, int room_count, int min_sz, int max_sz) {
             placed++;
         }
     }
+    MAP_END();
+    info_ring_doors(info, map);
+    info_finish(info);
 
-    free(rooms);
+    mfree(rooms);
+    MAP_END();
     return map;
 }
 
@@ -1694,6 +3048,7 @@ bool is_area_clear(Map map, int x, int y, int w, int h) {
 }
 
 Map xmgen_zorbus_like(int w, int h, int iterations, int percent_room) {
+    MAP_BEGIN("xmgen_zorbus_like");
     Map map = mnew(h, w);
     for(int y=0; y<h; y++) for(int x=0; x<w; x++) map.walling[y][x] = '#';
 
@@ -1709,8 +3064,8 @@ Map xmgen_zorbus_like(int w, int h, int iterations, int percent_room) {
         int tx, ty;
         bool found_wall = false;
         for(int try_wall = 0; try_wall < 500; try_wall++) {
-            tx = 1 + rand() % (w - 2);
-            ty = 1 + rand() % (h - 2);
+            tx = 1 + mrand() % (w - 2);
+            ty = 1 + mrand() % (h - 2);
             
             if (map.walling[ty][tx] == '#') {
         
@@ -1725,6 +3080,7 @@ Map xmgen_zorbus_like(int w, int h, int iterations, int percent_room) {
                     break;
                 }
             }
+            MAP_STAT(rejected, 1);
         }
 
         if (!found_wall) continue;
@@ -1737,11 +3093,11 @@ Map xmgen_zorbus_like(int w, int h, int iterations, int percent_room) {
         else dx = -1;
 
         //Send
-        if (rand() % 100 < percent_room) {
-            int rw = 4 + rand() % 5;
-            int rh = 4 + rand() % 5;
-            int rx = (dx == 1) ? tx : (dx == -1 ? tx - rw + 1 : tx - (rand() % rw));
-            int ry = (dy == 1) ? ty : (dy == -1 ? ty - rh + 1 : ty - (rand() % rh));
+        if (mrand() % 100 < percent_room) {
+            int rw = 4 + mrand() % 5;
+            int rh = 4 + mrand() % 5;
+            int rx = (dx == 1) ? tx : (dx == -1 ? tx - rw + 1 : tx - (mrand() % rw));
+            int ry = (dy == 1) ? ty : (dy == -1 ? ty - rh + 1 : ty - (mrand() % rh));
 
             if (is_area_clear(map, rx, ry, rw, rh)) {
                 for(int y = ry; y < ry + rh; y++)
@@ -1750,9 +3106,10 @@ Map xmgen_zorbus_like(int w, int h, int iterations, int percent_room) {
                 // Ensure a door/opening
                 map.walling[ty][tx] = ' '; 
             }
+            else MAP_STAT(rejected, 1);
         } else {
             
-            int len = 3 + rand() % 7;
+            int len = 3 + mrand() % 7;
             bool clear = true;
             for(int l=0; l<len; l++) {
                 if (!is_area_clear(map, tx + dx*l, ty + dy*l, 1, 1)) {
@@ -1762,14 +3119,17 @@ Map xmgen_zorbus_like(int w, int h, int iterations, int percent_room) {
             if (clear) {
                 for(int l=0; l<len; l++) map.walling[ty + dy*l][tx + dx*l] = '+';
             }
+            else MAP_STAT(rejected, 1);
         }
     }
+    MAP_END();
     return map;
 }
 
 
 Map xmgen_hub(const int w, const int h, const int hub_radius, const int spoke_count, const int room_min, const int room_max) {
-    srand((unsigned)time(0));
+    mseed();
+    MAP_BEGIN("xmgen_hub");
     Map map = mnew(h, w);
     
     // Carve the central hub as a circle
@@ -1789,13 +3149,13 @@ Map xmgen_hub(const int w, const int h, const int hub_radius, const int spoke_co
     
     for (int s = 0; s < spoke_count; s++) {
      
-        float angle = (float)rand() / RAND_MAX * 2.0f * 3.14159f;
+        float angle = (float)mrand() / MAP_RAND_MAX * 2.0f * 3.14159f;
         int dx = (int)(cosf(angle) * 1000);
         int dy = (int)(sinf(angle) * 1000);
         if (dx != 0) dx = (dx > 0) ? 1 : -1;
         if (dy != 0) dy = (dy > 0) ? 1 : -1;
      
-        int length = hub_radius + 5 + rand() % 10;
+        int length = hub_radius + 5 + mrand() % 10;
         int cx = hub_cx;
         int cy = hub_cy;
         for (int i = 0; i < length; i++) {
@@ -1806,8 +3166,8 @@ Map xmgen_hub(const int w, const int h, const int hub_radius, const int spoke_co
         }
         
         if (cx >= 1 && cx < w-1 && cy >= 1 && cy < h-1) {
-            int rw = room_min + rand() % (room_max - room_min + 1);
-            int rh = room_min + rand() % (room_max - room_min + 1);
+            int rw = room_min + mrand() % (room_max - room_min + 1);
+            int rh = room_min + mrand() % (room_max - room_min + 1);
             int rx = cx - rw/2;
             int ry = cy - rh/2;
             for (int yy = ry; yy < ry + rh; yy++) {
@@ -1818,12 +3178,14 @@ Map xmgen_hub(const int w, const int h, const int hub_radius, const int spoke_co
             }
         }
     }
+    MAP_END();
     return map;
 }
 
 
 Map xmgen_winding_path(const int w, const int h, const int max_path_len, const int room_chance, const int room_min, const int room_max) {
-    srand((unsigned)time(0));
+    mseed();
+    MAP_BEGIN("xmgen_winding_path");
     Map map = mnew(h, w);
     
     int x = w / 2;
@@ -1833,9 +3195,9 @@ Map xmgen_winding_path(const int w, const int h, const int max_path_len, const i
         if (x >= 0 && x < w && y >= 0 && y < h)
             map.walling[y][x] = ' ';
         
-        if (rand() % 100 < room_chance) {
-            int rw = room_min + rand() % (room_max - room_min + 1);
-            int rh = room_min + rand() % (room_max - room_min + 1);
+        if (mrand() % 100 < room_chance) {
+            int rw = room_min + mrand() % (room_max - room_min + 1);
+            int rh = room_min + mrand() % (room_max - room_min + 1);
             int rx = x - rw/2;
             int ry = y - rh/2;
             for (int yy = ry; yy < ry + rh; yy++) {
@@ -1847,7 +3209,7 @@ Map xmgen_winding_path(const int w, const int h, const int max_path_len, const i
         }
         
         // Random move
-        int dir = rand() % 4;
+        int dir = mrand() % 4;
         switch (dir) {
             case 0: y--; break;
             case 1: y++; break;
@@ -1859,12 +3221,14 @@ Map xmgen_winding_path(const int w, const int h, const int max_path_len, const i
         if (y < 1) y = 1;
         if (y >= h-1) y = h-2;
     }
+    MAP_END();
     return map;
 }
 
 
 Map xmgen_cross_sections(const int w, const int h, const int spacing, const int room_chance) {
-    srand((unsigned)time(0));
+    mseed();
+    MAP_BEGIN("xmgen_cross_sections");
     Map map = mnew(h, w);
     
     int step = (spacing < 3) ? 3 : spacing;
@@ -1882,9 +3246,9 @@ Map xmgen_cross_sections(const int w, const int h, const int spacing, const int
     
     for (int y = step; y < h-1; y += step) {
         for (int x = step; x < w-1; x += step) {
-            if (rand() % 100 < room_chance) {
-                int rw = 3 + rand() % 4;  // small rooms
-                int rh = 3 + rand() % 4;
+            if (mrand() % 100 < room_chance) {
+                int rw = 3 + mrand() % 4;  // small rooms
+                int rh = 3 + mrand() % 4;
                 int rx = x - rw/2;
                 int ry = y - rh/2;
                 for (int yy = ry; yy < ry + rh; yy++) {
@@ -1896,12 +3260,14 @@ Map xmgen_cross_sections(const int w, const int h, const int spacing, const int
             }
         }
     }
+    MAP_END();
     return map;
 }
 
 
 Map xmgen_rings(const int w, const int h, const int num_rings, const int ring_spacing, const int room_chance) {
-    srand((unsigned)time(0));
+    mseed();
+    MAP_BEGIN("xmgen_rings");
     Map map = mnew(h, w);
     
     int cx = w / 2;
@@ -1927,9 +3293,9 @@ Map xmgen_rings(const int w, const int h, const int num_rings, const int ring_sp
                     map.walling[py][px] = '+';
                     
             
-                    if (rand() % 100 < room_chance) {
-                        int rw = 3 + rand() % 4;
-                        int rh = 3 + rand() % 4;
+                    if (mrand() % 100 < room_chance) {
+                        int rw = 3 + mrand() % 4;
+                        int rh = 3 + mrand() % 4;
                         for (int dy = -rh/2; dy <= rh/2; dy++) {
                             for (int dx = -rw/2; dx <= rw/2; dx++) {
                                 int nx = px + dx, ny = py + dy;
@@ -1955,9 +3321,9 @@ Map xmgen_rings(const int w, const int h, const int num_rings, const int ring_sp
                     if (cx+dx > 0 && cx+dx < w-1 && cy+dy > 0 && cy+dy < h-1)
                         map.walling[cy+dy][cx+dx] = ' ';
         }
-        int spokes = 4 + rand() % 4;
+        int spokes = 4 + mrand() % 4;
         for (int s = 0; s < spokes; s++) {
-            float angle = (float)rand() / RAND_MAX * 2.0f * 3.14159f;
+            float angle = (float)mrand() / MAP_RAND_MAX * 2.0f * 3.14159f;
             int ex = cx + (int)(radius * cosf(angle));
             int ey = cy + (int)(radius * sinf(angle));
             int prev_radius = (r-1) * ring_spacing;
@@ -1970,14 +3336,17 @@ Map xmgen_rings(const int w, const int h, const int num_rings, const int ring_sp
             create_corridor(map, sx, sy, ex, ey);
         }
     }
+    MAP_END();
     return map;
 }
 
 /* ===================== Prefab Rooms Generator (30 prefabs) ===================== */
 
-Map xmgen_prefab_rooms(const int w, const int h, const int num_rooms, const int min_dist) {
-    srand((unsigned)time(0));
+Map xmgen_prefab_rooms(const int w, const int h, const int num_rooms, const int min_dist, MapInfo* info) {
+    mseed();
+    MAP_BEGIN("xmgen_prefab_rooms");
     Map map = mnew(h, w);
+    if (info) zero(*info);
 
     // Type for an offset from the room centre
     typedef struct { int dx, dy; } Offset;
@@ -2233,13 +3602,14 @@ static const Offset off_7x7_x[] = {
     int placed = 0;
     int attempts = 0;
 
+    MAP_BEGIN("place rooms");
     while (placed < num_rooms && attempts < num_rooms * 50) {
         attempts++;
-        int idx = rand() % num_prefabs;
+        int idx = mrand() % num_prefabs;
         const Prefab* p = &prefabs[idx];
 
-        int cx = 1 + rand() % (w - 2);
-        int cy = 1 + rand() % (h - 2);
+        int cx = 1 + mrand() % (w - 2);
+        int cy = 1 + mrand() % (h - 2);
 
         bool overlap = false;
         for (int i = 0; i < p->count; i++) {
@@ -2261,7 +3631,8 @@ static const Offset off_7x7_x[] = {
             }
         }
 
-        if (!overlap) {
+        if (overlap) MAP_STAT(rejected, 1);
+        else {
             for (int i = 0; i < p->count; i++) {
                 int nx = cx + p->offsets[i].dx;
                 int ny = cy + p->offsets[i].dy;
@@ -2269,12 +3640,15 @@ static const Offset off_7x7_x[] = {
             }
             centres[placed].cx = cx;
             centres[placed].cy = cy;
+            info_room(info, (Rect){cx - p->w / 2, cy - p->h / 2, p->w, p->h});
             placed++;
         }
     }
+    MAP_END();
 
+    MAP_BEGIN("connect");
     if (placed > 1) {
-        bool* connected = (bool*)calloc(placed, sizeof(bool));
+        bool* connected = (bool*)mcalloc(placed, sizeof(bool));
         connected[0] = true;
         int connected_count = 1;
 
@@ -2295,16 +3669,1938 @@ static const Offset off_7x7_x[] = {
             if (best_from != -1 && best_to != -1) {
                 create_corridor(map, centres[best_from].cx, centres[best_from].cy,
                                       centres[best_to].cx,   centres[best_to].cy);
+                info_corridor(info, best_from, best_to, centres[best_from].cx, centres[best_from].cy,
+                              centres[best_to].cx, centres[best_to].cy);
                 connected[best_to] = true;
                 connected_count++;
             } else break;
         }
-        free(connected);
+        mfree(connected);
     }
+    MAP_END();
+    info_ring_doors(info, map);
+    info_finish(info);
 
-    free(centres);
+    mfree(centres);
+    MAP_END();
     return map;
 }
 
 
+/* ===================== Generator registry ===================== */
+
+static Map gen_cellular(const int w, const int h, const float* a) { return xmgen_cellular(w, h, a[0], (int)a[1]); }
+static Map gen_delaunay(const int w, const int h, const float* a) { return xmgen(w, h, a[0] > 0 ? (int)a[0] : 3 + mrand() % 4, (int)a[1]); }
+static Map gen_graph(const int w, const int h, const float* a) { return xmgen_graph(w, h, (int)a[0], (int)a[1], (int)a[2], (int)a[3], NULL); }
+static Map gen_brogue(const int w, const int h, const float* a) { return xmgen_brogue(w, h, (int)a[0], (int)a[1], (int)a[2], NULL); }
+static Map gen_room_maze(const int w, const int h, const float* a) { return xmgen_room_maze(w, h, w - 2, h - 2, (int)a[0], (int)a[1], (int)a[2], NULL); }
+static Map gen_drunk(const int w, const int h, const float* a) { return xmgen_drunk(w, h, a[0]); }
+static Map gen_subtractive(const int w, const int h, const float* a) { return xmgen_subtractive(w, h, (int)a[0]); }
+static Map gen_perlin(const int w, const int h, const float* a) { return xmgen_perlin(w, h, a[0]); }
+static Map gen_maze(const int w, const int h, const float* a) { (void)a; return xmgen_maze(w, h, w - 2, h - 2); }
+static Map gen_bsp(const int w, const int h, const float* a) { return xmgen_bsp(w, h, (int)a[0], NULL); }
+static Map gen_scatter(const int w, const int h, const float* a) { return xmgen_scatter(w, h, (int)a[0], (int)a[1], (int)a[2], NULL); }
+static Map gen_zorbus(const int w, const int h, const float* a) { return xmgen_zorbus_like(w, h, (int)a[0], (int)a[1]); }
+static Map gen_hub(const int w, const int h, const float* a) { return xmgen_hub(w, h, (int)a[0], (int)a[1], (int)a[2], (int)a[3]); }
+static Map gen_winding(const int w, const int h, const float* a) { return xmgen_winding_path(w, h, (int)a[0], (int)a[1], (int)a[2], (int)a[3]); }
+static Map gen_cross_sections(const int w, const int h, const float* a) { return xmgen_cross_sections(w, h, (int)a[0], (int)a[1]); }
+static Map gen_rings(const int w, const int h, const float* a) { return xmgen_rings(w, h, (int)a[0], (int)a[1], (int)a[2]); }
+static Map gen_prefab(const int w, const int h, const float* a) { return xmgen_prefab_rooms(w, h, (int)a[0], (int)a[1], NULL); }
+
+// A delaunay grid of 0 picks 3 to 6 at random.
+const MapGenerator xmgenerators[] = {
+    { "cellular",       "Cellular Generator",       "wall_percent iterations",               { 0.45f, 1000 },     gen_cellular },
+    { "delaunay",       "Delaunay Graph Generator", "grid rooms",                            { 0, 30 },           gen_delaunay },
+    { "graph",          "Graph Generator",          "rooms min_size max_size extra",         { 30, 5, 20, 1 },    gen_graph },
+    { "brogue",         "Brogue Generator",         "rooms min_size max_size",               { 30, 5, 20 },       gen_brogue },
+    { "room_maze",      "Room Maze Generator",      "rooms min_size max_size",               { 30, 5, 20 },       gen_room_maze },
+    { "drunk",          "Drunk Generator",          "floor_percent",                         { 0.5f },            gen_drunk },
+    { "subtractive",    "Subtractive Generator",    "walks",                                 { 20 },              gen_subtractive },
+    { "perlin",         "Perlin Generator",         "threshold",                             { 0.1f },            gen_perlin },
+    { "maze",           "Maze Generator",           "",                                      { 0 },               gen_maze },
+    { "bsp",            "BSP Generator",            "min_room",                              { 5 },               gen_bsp },
+    { "scatter",        "Dummy Generator",          "rooms min_size max_size",               { 30, 5, 20 },       gen_scatter },
+    { "zorbus",         "Zorbus-like Generator",    "iterations room_percent",               { 500, 90 },         gen_zorbus },
+    { "hub",            "Hub Generator",            "radius spokes room_min room_max",       { 10, 30, 5, 20 },   gen_hub },
+    { "winding",        "Winding Drunk Generator",  "length room_chance room_min room_max",  { 20000, 1, 4, 5 }, gen_winding },
+    { "cross_sections", "Cross Sections Generator", "spacing room_chance",                   { 5, 50 },           gen_cross_sections },
+    { "rings",          "Ring Generator",           "rings spacing room_chance",             { 100, 30, 8 },      gen_rings },
+    { "prefab",         "Prefab Generator",         "rooms min_dist",                        { 50, 3 },           gen_prefab },
+};
+const int xmgenerator_count = sizeof(xmgenerators) / sizeof(xmgenerators[0]);
+
+Map xmgenerate(const MapGenerator* generator, const int w, const int h, const float* params) {
+    return generator->generate(w, h, params ? params : generator->defaults);
+}
+
+const MapGenerator* xmgenerator_find(const char* name) {
+    for (int i = 0; i < xmgenerator_count; i++)
+        if (!strcmp(xmgenerators[i].name, name)) return &xmgenerators[i];
+    return NULL;
+}
+
+/* ===================== Connectivity repair ===================== */
+
+// Labels 4-connected floor (anything but '#') into comp; walls get -1.
+// Returns the component count. queue is scratch for w * h ints.
+static int mlabel(const Map map, int* comp, int* queue) {
+    const int w = map.w;
+    const int n = w * map.h;
+    for (int i = 0; i < n; i++) comp[i] = map.walling[i / w][i % w] == '#' ? -1 : -2;
+    int count = 0;
+    for (int s = 0; s < n; s++) {
+        if (comp[s] != -2) continue;
+        int head = 0;
+        int tail = 0;
+        queue[tail++] = s;
+        comp[s] = count;
+        while (head < tail) {
+            const int i = queue[head++];
+            const int x = i % w;
+            const int y = i / w;
+            if (x > 0 && comp[i - 1] == -2) { comp[i - 1] = count; queue[tail++] = i - 1; }
+            if (x < w - 1 && comp[i + 1] == -2) { comp[i + 1] = count; queue[tail++] = i + 1; }
+            if (y > 0 && comp[i - w] == -2) { comp[i - w] = count; queue[tail++] = i - w; }
+            if (y < map.h - 1 && comp[i + w] == -2) { comp[i + w] = count; queue[tail++] = i + w; }
+        }
+        count++;
+    }
+    MAP_STAT(floods, count);
+    MAP_STAT(cells_visited, n);
+    return count;
+}
+
+// MAP_CONNECT_JOIN: one BFS from every floor tile at once grows each
+// component into the interior walls, remembering the owner, the distance
+// and the step back. Neighbouring tiles with different owners are bridges
+// costing dist[a] + dist[b] walls; taken cheapest first (counting sort)
+// through a union-find, they give a spanning set of short corridors, which
+// are carved as '+' along both parent chains.
+int xmconnect(Map* map, const int mode) {
+    const int w = map->w;
+    const int h = map->h;
+    const int n = w * h;
+    int* comp = toss(int, n);
+    int* queue = toss(int, n);
+    MAP_BEGIN("label");
+    const int count = mlabel(*map, comp, queue);
+    MAP_END();
+    if (count <= 1) {
+        mfree(comp);
+        mfree(queue);
+        return count;
+    }
+
+    if (mode == MAP_CONNECT_DROP_SMALL) {
+        int* size = (int*)mcalloc(count, sizeof(int));
+        for (int i = 0; i < n; i++)
+            if (comp[i] >= 0) size[comp[i]]++;
+        int largest = 0;
+        for (int c = 1; c < count; c++)
+            if (size[c] > size[largest]) largest = c;
+        for (int i = 0; i < n; i++)
+            if (comp[i] >= 0 && comp[i] != largest) map->walling[i / w][i % w] = '#';
+        mfree(size);
+        mfree(comp);
+        mfree(queue);
+        return count;
+    }
+
+    MAP_BEGIN("bridges");
+    int* dist = toss(int, n);
+    int* back = toss(int, n);
+    int tail = 0;
+    for (int i = 0; i < n; i++) {
+        dist[i] = comp[i] >= 0 ? 0 : -1;
+        back[i] = -1;
+        if (comp[i] >= 0) queue[tail++] = i;
+    }
+    int far = 0;
+    for (int head = 0; head < tail; head++) {
+        const int i = queue[head];
+        const int x = i % w;
+        const int y = i / w;
+        const int next[4] = { x > 1 ? i - 1 : -1, x < w - 2 ? i + 1 : -1, y > 1 ? i - w : -1, y < h - 2 ? i + w : -1 };
+        for (int k = 0; k < 4; k++) {
+            const int j = next[k];
+            if (j < 0 || dist[j] >= 0) continue;
+            dist[j] = dist[i] + 1;
+            comp[j] = comp[i];
+            back[j] = i;
+            if (dist[j] > far) far = dist[j];
+            queue[tail++] = j;
+        }
+    }
+    MAP_STAT(floods, 1);
+    MAP_STAT(cells_visited, tail);
+
+    // Bridges as i * 2 + (0 right, 1 down), bucketed by cost.
+    int* start = (int*)mcalloc(2 * far + 2, sizeof(int));
+    int* bridge = NULL;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < n; i++) {
+            if (comp[i] < 0) continue;
+            const int x = i % w;
+            const int y = i / w;
+            for (int k = 0; k < 2; k++) {
+                const int j = k ? i + w : i + 1;
+                if ((k ? y >= h - 1 : x >= w - 1) || comp[j] < 0 || comp[j] == comp[i]) continue;
+                const int cost = dist[i] + dist[j];
+                if (pass == 0) start[cost + 1]++;
+                else bridge[start[cost]++] = 2 * i + k;
+            }
+        }
+        if (pass == 0) {
+            for (int c = 0; c <= 2 * far; c++) start[c + 1] += start[c];
+            bridge = toss(int, start[2 * far + 1] + 1);
+        }
+    }
+    const int bridges = start[2 * far];
+
+    int* parent = toss(int, count);
+    for (int c = 0; c < count; c++) parent[c] = c;
+    int joined = 1;
+    for (int b = 0; b < bridges && joined < count; b++) {
+        const int i = bridge[b] / 2;
+        const int j = bridge[b] % 2 ? i + w : i + 1;
+        const int ra = uf_find(parent, comp[i]);
+        const int rb = uf_find(parent, comp[j]);
+        if (ra == rb) continue;
+        parent[rb] = ra;
+        joined++;
+        for (int t = i; t >= 0 && map->walling[t / w][t % w] == '#'; t = back[t]) map->walling[t / w][t % w] = '+';
+        for (int t = j; t >= 0 && map->walling[t / w][t % w] == '#'; t = back[t]) map->walling[t / w][t % w] = '+';
+    }
+    MAP_END();
+
+    mfree(parent);
+    mfree(bridge);
+    mfree(start);
+    mfree(back);
+    mfree(dist);
+    mfree(comp);
+    mfree(queue);
+    return count;
+}
+
+/* ===================== Distance maps ===================== */
+
+// Builds a 256-entry passability table; NULL means everything but '#'.
+static void mpassable(unsigned char* pass, const char* passable) {
+    if (!passable) {
+        memset(pass, 1, 256);
+        pass['#'] = 0;
+        return;
+    }
+    memset(pass, 0, 256);
+    for (; *passable; passable++)
+        pass[(unsigned char)*passable] = 1;
+}
+
+#define DISTANCE_QUEUED 0x8000
+
+void xmdistance(const Map map, const int* sources, const int n, const char* passable, const int flags, unsigned short* out, int* frontier) {
+    unsigned char pass[256];
+    mpassable(pass, passable);
+
+    const int w = map.w;
+    const int h = map.h;
+    for (int y = 0; y < h; y++) {
+        const char* row = map.walling[y];
+        unsigned short* o = out + y * w;
+        for (int x = 0; x < w; x++)
+            o[x] = pass[(unsigned char)row[x]] ? MAP_DISTANCE_UNREACHABLE : MAP_DISTANCE_BLOCKED;
+    }
+
+    const int size = w * h;
+    const bool chamfer = (flags & MAP_DISTANCE_CHAMFER) != 0;
+    MAP_STAT(floods, 1);
+    int head = 0;
+    int tail = 0;
+    for (int s = 0; s < n; s++) {
+        const int i = sources[s];
+        if (i < 0 || i >= size || out[i] != MAP_DISTANCE_UNREACHABLE) continue;
+        out[i] = chamfer ? DISTANCE_QUEUED : 0;
+        frontier[tail++] = i;
+    }
+
+    if (!chamfer) {
+        // Plain BFS: every tile is queued once, in order of distance.
+        while (head < tail) {
+            const int i = frontier[head++];
+            const int x = i % w;
+            const unsigned short d = out[i] < MAP_DISTANCE_MAX ? out[i] + 1 : MAP_DISTANCE_MAX;
+            if (x > 0 && out[i - 1] == MAP_DISTANCE_UNREACHABLE) { out[i - 1] = d; frontier[tail++] = i - 1; }
+            if (x < w - 1 && out[i + 1] == MAP_DISTANCE_UNREACHABLE) { out[i + 1] = d; frontier[tail++] = i + 1; }
+            if (i >= w && out[i - w] == MAP_DISTANCE_UNREACHABLE) { out[i - w] = d; frontier[tail++] = i - w; }
+            if (i < size - w && out[i + w] == MAP_DISTANCE_UNREACHABLE) { out[i + w] = d; frontier[tail++] = i + w; }
+        }
+        MAP_STAT(cells_visited, tail);
+        return;
+    }
+
+    // Chamfer 2-3: label-correcting over a circular frontier. Bit 15 of a
+    // distance marks a tile that is already queued, so a tile is never in
+    // the frontier twice and w * h entries always suffice.
+    int count = tail;
+    tail %= size;
+    const int dx[] = {1, -1, 0, 0, 1, 1, -1, -1};
+    const int dy[] = {0, 0, 1, -1, 1, -1, 1, -1};
+    while (count > 0) {
+        const int i = frontier[head];
+        head = head + 1 == size ? 0 : head + 1;
+        count--;
+        MAP_STAT(cells_visited, 1);
+        const int x = i % w;
+        const int y = i / w;
+        out[i] &= ~DISTANCE_QUEUED;
+        const int d = out[i];
+
+        for (int k = 0; k < 8; k++) {
+            const int nx = x + dx[k];
+            const int ny = y + dy[k];
+            if (nx < 0 || ny < 0 || nx >= w || ny >= h) continue;
+            const int ni = ny * w + nx;
+            const unsigned short v = out[ni];
+            if (v == MAP_DISTANCE_BLOCKED) continue;
+            if (k >= 4 && (out[i + dx[k]] == MAP_DISTANCE_BLOCKED || out[i + dy[k] * w] == MAP_DISTANCE_BLOCKED)) continue;
+
+            int nd = d + (k < 4 ? 2 : 3);
+            if (nd > MAP_DISTANCE_CHAMFER_MAX) nd = MAP_DISTANCE_CHAMFER_MAX;
+            const bool unseen = v == MAP_DISTANCE_UNREACHABLE;
+            if (!unseen && nd >= (v & ~DISTANCE_QUEUED)) continue;
+
+            out[ni] = (unsigned short)(nd | DISTANCE_QUEUED);
+            if (unseen || !(v & DISTANCE_QUEUED)) {
+                frontier[tail] = ni;
+                tail = tail + 1 == size ? 0 : tail + 1;
+                count++;
+            }
+        }
+    }
+}
+
+
+/* ===================== Jump Point Search ===================== */
+
+// Walkability is kept twice, as row bitmaps and as column bitmaps, so that
+// straight jumps in any of the four directions are word-wide bit scans.
+// Costs are 5 per straight step and 7 per diagonal one.
+#define PATH_STRAIGHT 5
+#define PATH_DIAGONAL 7
+
+static inline int path_octile(const int ax, const int ay, const int bx, const int by) {
+    const int dx = abs(ax - bx);
+    const int dy = abs(ay - by);
+    return dx < dy ? PATH_DIAGONAL * dx + PATH_STRAIGHT * (dy - dx)
+                   : PATH_DIAGONAL * dy + PATH_STRAIGHT * (dx - dy);
+}
+
+static inline bool path_walkable(const MapPath* p, const int x, const int y) {
+    if (x < 0 || y < 0 || x >= p->w || y >= p->h) return false;
+    return (p->rows[y * p->row_words + (x >> 6)] >> (x & 63)) & 1;
+}
+
+static inline int path_ctz(const uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(v);
+#else
+    int n = 0;
+    while (!((v >> n) & 1)) n++;
+    return n;
+#endif
+}
+
+static inline int path_clz(const uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(v);
+#else
+    int n = 0;
+    while (!((v >> (63 - n)) & 1)) n++;
+    return n;
+#endif
+}
+
+// Straight jump along one bitmap line (a row, or a column of the transposed
+// bitmap) from pos in direction dir. side_a and side_b are the two
+// neighbouring lines, NULL outside the map. A cell is a jump point when a
+// side cell is open but the side cell behind it is not; the scan stops at
+// the first blocked cell. Returns the jump point position or -1.
+static int path_jump_line(const uint64_t* line, const uint64_t* side_a, const uint64_t* side_b, const int words, const int pos, const int dir, const int goal) {
+    int k = pos >> 6;
+    if (dir > 0) {
+        uint64_t carry_a = k > 0 && side_a ? side_a[k - 1] >> 63 : 0;
+        uint64_t carry_b = k > 0 && side_b ? side_b[k - 1] >> 63 : 0;
+        uint64_t mask = ~0ULL << (pos & 63);
+        for (; k < words; k++) {
+            const uint64_t a = side_a ? side_a[k] : 0;
+            const uint64_t b = side_b ? side_b[k] : 0;
+            uint64_t hit = (a & ~(a << 1 | carry_a)) | (b & ~(b << 1 | carry_b));
+            if (goal >= 0 && goal >> 6 == k) hit |= 1ULL << (goal & 63);
+            const uint64_t blocked = ~line[k] & mask;
+            hit &= mask;
+            carry_a = a >> 63;
+            carry_b = b >> 63;
+            mask = ~0ULL;
+            if (hit && (!blocked || path_ctz(hit) < path_ctz(blocked))) return (k << 6) + path_ctz(hit);
+            if (blocked) return -1;
+        }
+    } else {
+        uint64_t carry_a = k + 1 < words && side_a ? side_a[k + 1] << 63 : 0;
+        uint64_t carry_b = k + 1 < words && side_b ? side_b[k + 1] << 63 : 0;
+        uint64_t mask = ~0ULL >> (63 - (pos & 63));
+        for (; k >= 0; k--) {
+            const uint64_t a = side_a ? side_a[k] : 0;
+            const uint64_t b = side_b ? side_b[k] : 0;
+            uint64_t hit = (a & ~(a >> 1 | carry_a)) | (b & ~(b >> 1 | carry_b));
+            if (goal >= 0 && goal >> 6 == k) hit |= 1ULL << (goal & 63);
+            const uint64_t blocked = ~line[k] & mask;
+            hit &= mask;
+            carry_a = a << 63;
+            carry_b = b << 63;
+            mask = ~0ULL;
+            if (hit && (!blocked || path_clz(hit) < path_clz(blocked))) return (k << 6) + 63 - path_clz(hit);
+            if (blocked) return -1;
+        }
+    }
+    return -1;
+}
+
+static int path_jump_h(const MapPath* p, const int x, const int y, const int dx, const int gx, const int gy) {
+    if (x < 0 || x >= p->w) return -1;
+    const uint64_t* row = p->rows + y * p->row_words;
+    const uint64_t* up = y > 0 ? row - p->row_words : NULL;
+    const uint64_t* down = y < p->h - 1 ? row + p->row_words : NULL;
+    const int jx = path_jump_line(row, up, down, p->row_words, x, dx, gy == y ? gx : -1);
+    return jx < 0 ? -1 : y * p->w + jx;
+}
+
+static int path_jump_v(const MapPath* p, const int x, const int y, const int dy, const int gx, const int gy) {
+    if (y < 0 || y >= p->h) return -1;
+    const uint64_t* col = p->cols + x * p->col_words;
+    const uint64_t* left = x > 0 ? col - p->col_words : NULL;
+    const uint64_t* right = x < p->w - 1 ? col + p->col_words : NULL;
+    const int jy = path_jump_line(col, left, right, p->col_words, y, dy, gx == x ? gy : -1);
+    return jy < 0 ? -1 : jy * p->w + x;
+}
+
+// Diagonal jump: step while both orthogonal cells are open, and stop where
+// a straight jump out of the current cell finds something.
+static int path_jump_d(const MapPath* p, int x, int y, const int dx, const int dy, const int gx, const int gy) {
+    for (;;) {
+        if (!path_walkable(p, x, y)) return -1;
+        if (x == gx && y == gy) return y * p->w + x;
+        if (path_jump_h(p, x + dx, y, dx, gx, gy) >= 0 || path_jump_v(p, x, y + dy, dy, gx, gy) >= 0)
+            return y * p->w + x;
+        if (!path_walkable(p, x + dx, y) || !path_walkable(p, x, y + dy)) return -1;
+        x += dx;
+        y += dy;
+    }
+}
+
+static int path_jump(const MapPath* p, const int x, const int y, const int dx, const int dy, const int gx, const int gy) {
+    if (dx && dy) return path_jump_d(p, x, y, dx, dy, gx, gy);
+    if (!path_walkable(p, x, y)) return -1;
+    if (dx) return path_jump_h(p, x, y, dx, gx, gy);
+    return path_jump_v(p, x, y, dy, gx, gy);
+}
+
+static void path_push(MapPath* p, const int f, const int node) {
+    if (p->heap_count == p->heap_cap) {
+        p->heap_cap = p->heap_cap ? 2 * p->heap_cap : 256;
+        p->heap = (uint64_t*)mrealloc(p->heap, p->heap_cap * sizeof(uint64_t));
+    }
+    const uint64_t item = (uint64_t)f << 32 | (unsigned)node;
+    int i = p->heap_count++;
+    while (i > 0 && p->heap[(i - 1) / 2] > item) {
+        p->heap[i] = p->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    p->heap[i] = item;
+}
+
+static int path_pop(MapPath* p) {
+    const int node = (int)(p->heap[0] & 0xFFFFFFFFu);
+    const uint64_t last = p->heap[--p->heap_count];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= p->heap_count) break;
+        if (child + 1 < p->heap_count && p->heap[child + 1] < p->heap[child]) child++;
+        if (p->heap[child] >= last) break;
+        p->heap[i] = p->heap[child];
+        i = child;
+    }
+    p->heap[i] = last;
+    return node;
+}
+
+MapPath xmpath_new(const Map map, const char* blocked) {
+    unsigned char block[256];
+    memset(block, 0, 256);
+    block['#'] = 1;
+    if (blocked)
+        for (; *blocked; blocked++) block[(unsigned char)*blocked] = 1;
+
+    MapPath p;
+    zero(p);
+    p.w = map.w;
+    p.h = map.h;
+    p.row_words = (map.w + 63) / 64;
+    p.col_words = (map.h + 63) / 64;
+    p.rows = (uint64_t*)mcalloc((size_t)p.row_words * map.h, sizeof(uint64_t));
+    p.cols = (uint64_t*)mcalloc((size_t)p.col_words * map.w, sizeof(uint64_t));
+    p.g = toss(int, map.w * map.h);
+    p.parent = toss(int, map.w * map.h);
+    p.stamp = (unsigned*)mcalloc(map.w * map.h, sizeof(unsigned));
+    for (int y = 0; y < map.h; y++)
+        for (int x = 0; x < map.w; x++)
+            xmpath_set(&p, x, y, !block[(unsigned char)map.walling[y][x]]);
+    return p;
+}
+
+void xmpath_set(MapPath* p, const int x, const int y, const bool walkable) {
+    uint64_t* r = &p->rows[y * p->row_words + (x >> 6)];
+    uint64_t* c = &p->cols[x * p->col_words + (y >> 6)];
+    if (walkable) {
+        *r |= 1ULL << (x & 63);
+        *c |= 1ULL << (y & 63);
+    } else {
+        *r &= ~(1ULL << (x & 63));
+        *c &= ~(1ULL << (y & 63));
+    }
+}
+
+void xmpath_free(MapPath* p) {
+    mfree(p->rows);
+    mfree(p->cols);
+    mfree(p->g);
+    mfree(p->parent);
+    mfree(p->stamp);
+    mfree(p->heap);
+    zero(*p);
+}
+
+// A* over jump points. stamp[n] == 2 * query marks an open node of this
+// query and 2 * query + 1 a closed one, so nothing is cleared between calls.
+int xmpath(MapPath* p, const int sx, const int sy, const int ex, const int ey, int* path, const int max) {
+    if (!path_walkable(p, sx, sy) || !path_walkable(p, ex, ey)) return -1;
+
+    const int w = p->w;
+    if (++p->query >= 0x7FFFFFFF) {
+        memset(p->stamp, 0, (size_t)w * p->h * sizeof(unsigned));
+        p->query = 1;
+    }
+    const unsigned open = 2 * p->query;
+    const unsigned closed = open + 1;
+    const int start = sy * w + sx;
+    const int goal = ey * w + ex;
+
+    p->heap_count = 0;
+    p->g[start] = 0;
+    p->parent[start] = -1;
+    p->stamp[start] = open;
+    path_push(p, path_octile(sx, sy, ex, ey), start);
+
+    bool found = false;
+    while (p->heap_count > 0) {
+        const int node = path_pop(p);
+        if (p->stamp[node] == closed) continue;
+        p->stamp[node] = closed;
+        if (node == goal) {
+            found = true;
+            break;
+        }
+        const int x = node % w;
+        const int y = node / w;
+
+        // Pruned neighbour directions, as in JPS without corner cutting.
+        int dirs[8][2];
+        int dir_count = 0;
+        if (p->parent[node] < 0) {
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++) {
+                    if (!dx && !dy) continue;
+                    if (dx && dy && (!path_walkable(p, x + dx, y) || !path_walkable(p, x, y + dy))) continue;
+                    dirs[dir_count][0] = dx;
+                    dirs[dir_count][1] = dy;
+                    dir_count++;
+                }
+        } else {
+            const int px = p->parent[node] % w;
+            const int py = p->parent[node] / w;
+            const int dx = (x > px) - (x < px);
+            const int dy = (y > py) - (y < py);
+            if (dx && dy) {
+                const bool walk_x = path_walkable(p, x + dx, y);
+                const bool walk_y = path_walkable(p, x, y + dy);
+                if (walk_y) { dirs[dir_count][0] = 0; dirs[dir_count][1] = dy; dir_count++; }
+                if (walk_x) { dirs[dir_count][0] = dx; dirs[dir_count][1] = 0; dir_count++; }
+                if (walk_x && walk_y) { dirs[dir_count][0] = dx; dirs[dir_count][1] = dy; dir_count++; }
+            } else if (dx) {
+                const bool next = path_walkable(p, x + dx, y);
+                const bool up = path_walkable(p, x, y - 1);
+                const bool down = path_walkable(p, x, y + 1);
+                if (next) {
+                    dirs[dir_count][0] = dx; dirs[dir_count][1] = 0; dir_count++;
+                    if (up) { dirs[dir_count][0] = dx; dirs[dir_count][1] = -1; dir_count++; }
+                    if (down) { dirs[dir_count][0] = dx; dirs[dir_count][1] = 1; dir_count++; }
+                }
+                if (up) { dirs[dir_count][0] = 0; dirs[dir_count][1] = -1; dir_count++; }
+                if (down) { dirs[dir_count][0] = 0; dirs[dir_count][1] = 1; dir_count++; }
+            } else {
+                const bool next = path_walkable(p, x, y + dy);
+                const bool left = path_walkable(p, x - 1, y);
+                const bool right = path_walkable(p, x + 1, y);
+                if (next) {
+                    dirs[dir_count][0] = 0; dirs[dir_count][1] = dy; dir_count++;
+                    if (left) { dirs[dir_count][0] = -1; dirs[dir_count][1] = dy; dir_count++; }
+                    if (right) { dirs[dir_count][0] = 1; dirs[dir_count][1] = dy; dir_count++; }
+                }
+                if (left) { dirs[dir_count][0] = -1; dirs[dir_count][1] = 0; dir_count++; }
+                if (right) { dirs[dir_count][0] = 1; dirs[dir_count][1] = 0; dir_count++; }
+            }
+        }
+
+        for (int d = 0; d < dir_count; d++) {
+            const int jp = path_jump(p, x + dirs[d][0], y + dirs[d][1], dirs[d][0], dirs[d][1], ex, ey);
+            if (jp < 0 || p->stamp[jp] == closed) continue;
+            const int jx = jp % w;
+            const int jy = jp / w;
+            const int g = p->g[node] + path_octile(x, y, jx, jy);
+            if (p->stamp[jp] == open && g >= p->g[jp]) continue;
+            p->stamp[jp] = open;
+            p->g[jp] = g;
+            p->parent[jp] = node;
+            path_push(p, g + path_octile(jx, jy, ex, ey), jp);
+        }
+    }
+    if (!found) return -1;
+
+    // Jump points are joined by straight or diagonal runs; count the tiles
+    // first, then fill the path back to front.
+    int length = 1;
+    for (int n = goal; p->parent[n] >= 0; n = p->parent[n]) {
+        const int dx = abs(n % w - p->parent[n] % w);
+        const int dy = abs(n / w - p->parent[n] / w);
+        length += dx > dy ? dx : dy;
+    }
+    if (path && max >= length) {
+        int i = length - 1;
+        path[i] = goal;
+        for (int n = goal; p->parent[n] >= 0; n = p->parent[n]) {
+            const int from = p->parent[n];
+            const int sx_step = (from % w > n % w) - (from % w < n % w);
+            const int sy_step = (from / w > n / w) - (from / w < n / w);
+            int cx = n % w;
+            int cy = n / w;
+            while (cy * w + cx != from) {
+                cx += sx_step;
+                cy += sy_step;
+                path[--i] = cy * w + cx;
+            }
+        }
+    }
+    return length;
+}
+
+/* ===================== Hierarchical pathfinding ===================== */
+
+// The map is cut into size x size clusters. Every open run along a cluster
+// border gets one entrance pair in its middle, or one at each end when the
+// run is 6 tiles or longer. Entrance tiles are the abstract nodes; edges are
+// the precomputed shortest paths inside a cluster plus the 5-cost step across
+// the border. Edits mark clusters dirty and the next query rebuilds only
+// those clusters and their four neighbours.
+#define HPA_FAR 0x7FFFFFFF
+#define HPA_TILES 1
+#define HPA_NODES 2
+
+static int hpa_border(const MapPath* p, int tile, const int along, const int across, const int len, int* out) {
+    int count = 0;
+    int run = 0;
+    for (int i = 0; i <= len; i++, tile += along) {
+        const bool open = i < len
+            && path_walkable(p, tile % p->w, tile / p->w)
+            && path_walkable(p, (tile + across) % p->w, (tile + across) / p->w);
+        if (open) {
+            run++;
+            continue;
+        }
+        if (run >= 6) {
+            out[count++] = tile - run * along;
+            out[count++] = tile - along;
+        } else if (run > 0)
+            out[count++] = tile - (run + 1) / 2 * along;
+        run = 0;
+    }
+    return count;
+}
+
+static const int hpa_dx[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+static const int hpa_dy[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+
+// Loads cluster (cx, cy) into h->grid as one byte per tile holding the
+// legal moves out of it (bit s for direction s above, no corner cutting).
+// A closed one-tile rim keeps searches inside the cluster.
+static void hpa_grid(MapHpa* h, const int cx, const int cy) {
+    const MapPath* p = &h->path;
+    const int x0 = cx * h->size;
+    const int y0 = cy * h->size;
+    const int lw = x0 + h->size < p->w ? h->size : p->w - x0;
+    const int lh = y0 + h->size < p->h ? h->size : p->h - y0;
+    const int stride = h->size + 2;
+    unsigned char* open = h->grid + stride * stride;
+    memset(open, 0, stride * stride);
+    for (int y = 0; y < lh; y++)
+        for (int x = 0; x < lw; x++)
+            open[(y + 1) * stride + x + 1] = path_walkable(p, x0 + x, y0 + y);
+    memset(h->grid, 0, stride * stride);
+    for (int y = 1; y <= lh; y++)
+        for (int x = 1; x <= lw; x++) {
+            const int i = y * stride + x;
+            if (!open[i]) continue;
+            unsigned char moves = 0;
+            for (int s = 0; s < 8; s++) {
+                const bool ok = open[i + hpa_dy[s] * stride + hpa_dx[s]]
+                    && open[i + hpa_dx[s]] && open[i + hpa_dy[s] * stride];
+                moves |= ok << s;
+            }
+            h->grid[i] = moves;
+        }
+}
+
+// Dijkstra from tile inside the cluster last loaded by hpa_grid. Steps cost
+// 5 or 7, so a ring of 8 buckets replaces the heap. Distances land in
+// h->local, indexed like the grid.
+static void hpa_local(MapHpa* h, const int cx, const int cy, const int from) {
+    const MapPath* p = &h->path;
+    const int stride = h->size + 2;
+    for (int i = 0; i < stride * stride; i++) h->local[i] = HPA_FAR;
+
+    int step[8];
+    int cost[8];
+    for (int s = 0; s < 8; s++) {
+        step[s] = hpa_dy[s] * stride + hpa_dx[s];
+        cost[s] = hpa_dx[s] && hpa_dy[s] ? PATH_DIAGONAL : PATH_STRAIGHT;
+    }
+    const int cap = 8 * stride * stride;
+    int count[8] = { 0 };
+    int pending = 1;
+    const int first = (from / p->w - cy * h->size + 1) * stride + from % p->w - cx * h->size + 1;
+    h->local[first] = 0;
+    h->bucket[0] = first;
+    count[0] = 1;
+    for (int d = 0; pending > 0; d++) {
+        int* bucket = h->bucket + (d & 7) * cap;
+        const int n = count[d & 7];
+        count[d & 7] = 0;
+        pending -= n;
+        for (int b = 0; b < n; b++) {
+            const int i = bucket[b];
+            if (h->local[i] != d) continue;
+            for (unsigned moves = h->grid[i]; moves; moves &= moves - 1) {
+                const int s = path_ctz(moves);
+                const int j = i + step[s];
+                const int nd = d + cost[s];
+                if (nd < h->local[j]) {
+                    h->local[j] = nd;
+                    h->bucket[(nd & 7) * cap + count[nd & 7]++] = j;
+                    pending++;
+                }
+            }
+        }
+    }
+}
+
+static inline int hpa_local_at(const MapHpa* h, const int cx, const int cy, const int tile) {
+    const int stride = h->size + 2;
+    return h->local[(tile / h->path.w - cy * h->size + 1) * stride + tile % h->path.w - cx * h->size + 1];
+}
+
+static void hpa_borders(MapHpa* h, const int cx, const int cy) {
+    const MapPath* p = &h->path;
+    MapCluster* c = &h->clusters[cy * h->cw + cx];
+    const int x0 = cx * h->size;
+    const int y0 = cy * h->size;
+    c->east_count = 0;
+    c->south_count = 0;
+    if (cx + 1 < h->cw) {
+        const int len = y0 + h->size < p->h ? h->size : p->h - y0;
+        c->east_count = hpa_border(p, y0 * p->w + x0 + h->size - 1, p->w, 1, len, c->east);
+    }
+    if (cy + 1 < h->ch) {
+        const int len = x0 + h->size < p->w ? h->size : p->w - x0;
+        c->south_count = hpa_border(p, (y0 + h->size - 1) * p->w + x0, 1, p->w, len, c->south);
+    }
+}
+
+static void hpa_add_node(MapHpa* h, MapCluster* c, const int tile, const int twin) {
+    int i = h->node_at[tile];
+    if (i < 0) {
+        i = c->node_count++;
+        h->node_at[tile] = i;
+        c->nodes[i] = tile;
+        c->twins[2 * i] = -1;
+        c->twins[2 * i + 1] = -1;
+    }
+    c->twins[2 * i + (c->twins[2 * i] >= 0)] = twin;
+}
+
+static void hpa_nodes(MapHpa* h, const int cx, const int cy) {
+    const int w = h->path.w;
+    MapCluster* c = &h->clusters[cy * h->cw + cx];
+    for (int i = 0; i < c->node_count; i++) h->node_at[c->nodes[i]] = -1;
+    c->node_count = 0;
+
+    for (int i = 0; i < c->east_count; i++) hpa_add_node(h, c, c->east[i], c->east[i] + 1);
+    for (int i = 0; i < c->south_count; i++) hpa_add_node(h, c, c->south[i], c->south[i] + w);
+    if (cx > 0) {
+        const MapCluster* west = c - 1;
+        for (int i = 0; i < west->east_count; i++) hpa_add_node(h, c, west->east[i] + 1, west->east[i]);
+    }
+    if (cy > 0) {
+        const MapCluster* north = c - h->cw;
+        for (int i = 0; i < north->south_count; i++) hpa_add_node(h, c, north->south[i] + w, north->south[i]);
+    }
+
+    const int k = c->node_count;
+    hpa_grid(h, cx, cy);
+    c->dist = (int*)mrealloc(c->dist, (k ? k * k : 1) * sizeof(int));
+    for (int i = 0; i < k; i++) {
+        c->dist[i * k + i] = 0;
+        if (i == k - 1) break;
+        hpa_local(h, cx, cy, c->nodes[i]);
+        for (int j = i + 1; j < k; j++) {
+            const int d = hpa_local_at(h, cx, cy, c->nodes[j]);
+            c->dist[i * k + j] = c->dist[j * k + i] = d == HPA_FAR ? -1 : d;
+        }
+    }
+}
+
+static void hpa_refresh(MapHpa* h) {
+    if (!h->dirty) return;
+    for (int cy = 0; cy < h->ch; cy++)
+        for (int cx = 0; cx < h->cw; cx++) {
+            MapCluster* c = &h->clusters[cy * h->cw + cx];
+            if (!(c->dirty & HPA_TILES)) continue;
+            hpa_borders(h, cx, cy);
+            c->dirty |= HPA_NODES;
+            if (cx > 0) { hpa_borders(h, cx - 1, cy); c[-1].dirty |= HPA_NODES; }
+            if (cy > 0) { hpa_borders(h, cx, cy - 1); c[-h->cw].dirty |= HPA_NODES; }
+            if (cx + 1 < h->cw) c[1].dirty |= HPA_NODES;
+            if (cy + 1 < h->ch) c[h->cw].dirty |= HPA_NODES;
+        }
+    for (int cy = 0; cy < h->ch; cy++)
+        for (int cx = 0; cx < h->cw; cx++) {
+            MapCluster* c = &h->clusters[cy * h->cw + cx];
+            if (c->dirty & HPA_NODES) hpa_nodes(h, cx, cy);
+            c->dirty = 0;
+        }
+    h->dirty = false;
+}
+
+MapHpa xmhpa_new(const Map map, const char* blocked, int cluster) {
+    if (cluster <= 0) cluster = 16;
+    if (cluster < 4) cluster = 4;
+
+    MapHpa h;
+    zero(h);
+    h.path = xmpath_new(map, blocked);
+    h.size = cluster;
+    h.cw = (map.w + cluster - 1) / cluster;
+    h.ch = (map.h + cluster - 1) / cluster;
+    h.node_cap = 4 * (cluster + 2);
+    h.clusters = (MapCluster*)mcalloc(h.cw * h.ch, sizeof(MapCluster));
+    h.node_at = toss(int, map.w * map.h);
+    for (int i = 0; i < map.w * map.h; i++) h.node_at[i] = -1;
+
+    // Fixed-size cluster arrays share one block: nodes, twins, east, south.
+    const int stride = h.node_cap * 3 + 2 * (cluster + 2);
+    h.pool = toss(int, h.cw * h.ch * stride);
+    for (int i = 0; i < h.cw * h.ch; i++) {
+        MapCluster* c = &h.clusters[i];
+        c->nodes = h.pool + i * stride;
+        c->twins = c->nodes + h.node_cap;
+        c->east = c->twins + 2 * h.node_cap;
+        c->south = c->east + cluster + 2;
+        c->dirty = HPA_TILES;
+    }
+    h.local = toss(int, (cluster + 2) * (cluster + 2));
+    h.grid = toss(unsigned char, 2 * (cluster + 2) * (cluster + 2));
+    h.bucket = toss(int, 64 * (cluster + 2) * (cluster + 2));
+    h.start_dist = toss(int, 2 * h.node_cap);
+    h.goal_dist = h.start_dist + h.node_cap;
+    h.dirty = true;
+    hpa_refresh(&h);
+    return h;
+}
+
+void xmhpa_set(MapHpa* h, const int x, const int y, const bool walkable) {
+    xmpath_set(&h->path, x, y, walkable);
+    h->clusters[(y / h->size) * h->cw + x / h->size].dirty |= HPA_TILES;
+    h->dirty = true;
+}
+
+void xmhpa_free(MapHpa* h) {
+    for (int i = 0; i < h->cw * h->ch; i++) mfree(h->clusters[i].dist);
+    mfree(h->clusters);
+    mfree(h->node_at);
+    mfree(h->pool);
+    mfree(h->local);
+    mfree(h->grid);
+    mfree(h->bucket);
+    mfree(h->start_dist);
+    xmpath_free(&h->path);
+    zero(*h);
+}
+
+static void hpa_relax(MapPath* p, const int from, const int to, const int cost, const unsigned open, const int ex, const int ey) {
+    if (p->stamp[to] == open + 1) return;
+    const int g = p->g[from] + cost;
+    if (p->stamp[to] == open && g >= p->g[to]) return;
+    p->stamp[to] = open;
+    p->g[to] = g;
+    p->parent[to] = from;
+    path_push(p, g + path_octile(to % p->w, to / p->w, ex, ey), to);
+}
+
+// A* over the abstract graph. Only the start and goal clusters are searched
+// tile by tile; everything else uses the cached cluster distances. The
+// result is a list of waypoints, each pair joined by an xmpath query on
+// h->path that stays inside one cluster or crosses one border.
+int xmhpa(MapHpa* h, const int sx, const int sy, const int ex, const int ey, int* waypoints, const int max) {
+    MapPath* p = &h->path;
+    hpa_refresh(h);
+    if (!path_walkable(p, sx, sy) || !path_walkable(p, ex, ey)) return -1;
+
+    const int w = p->w;
+    const int start = sy * w + sx;
+    const int goal = ey * w + ex;
+    const int scx = sx / h->size, scy = sy / h->size;
+    const int gcx = ex / h->size, gcy = ey / h->size;
+    const MapCluster* sc = &h->clusters[scy * h->cw + scx];
+    const MapCluster* gc = &h->clusters[gcy * h->cw + gcx];
+
+    hpa_grid(h, scx, scy);
+    hpa_local(h, scx, scy, start);
+    int direct = -1;
+    if (sc == gc) {
+        const int d = hpa_local_at(h, scx, scy, goal);
+        direct = d == HPA_FAR ? -1 : d;
+    }
+    for (int i = 0; i < sc->node_count; i++) {
+        const int d = hpa_local_at(h, scx, scy, sc->nodes[i]);
+        h->start_dist[i] = d == HPA_FAR ? -1 : d;
+    }
+    hpa_grid(h, gcx, gcy);
+    hpa_local(h, gcx, gcy, goal);
+    for (int i = 0; i < gc->node_count; i++) {
+        const int d = hpa_local_at(h, gcx, gcy, gc->nodes[i]);
+        h->goal_dist[i] = d == HPA_FAR ? -1 : d;
+    }
+
+    if (++p->query >= 0x7FFFFFFF) {
+        memset(p->stamp, 0, (size_t)w * p->h * sizeof(unsigned));
+        p->query = 1;
+    }
+    const unsigned open = 2 * p->query;
+    const unsigned closed = open + 1;
+    p->heap_count = 0;
+    p->g[start] = 0;
+    p->parent[start] = -1;
+    p->stamp[start] = open;
+    path_push(p, path_octile(sx, sy, ex, ey), start);
+
+    bool found = false;
+    while (p->heap_count > 0) {
+        const int node = path_pop(p);
+        if (p->stamp[node] == closed) continue;
+        p->stamp[node] = closed;
+        if (node == goal) {
+            found = true;
+            break;
+        }
+        if (node == start) {
+            for (int i = 0; i < sc->node_count; i++)
+                if (h->start_dist[i] >= 0) hpa_relax(p, node, sc->nodes[i], h->start_dist[i], open, ex, ey);
+            if (direct >= 0) hpa_relax(p, node, goal, direct, open, ex, ey);
+        }
+        const int i = h->node_at[node];
+        if (i < 0) continue;
+        const MapCluster* c = &h->clusters[(node / w / h->size) * h->cw + node % w / h->size];
+        const int k = c->node_count;
+        for (int j = 0; j < k; j++)
+            if (j != i && c->dist[i * k + j] >= 0) hpa_relax(p, node, c->nodes[j], c->dist[i * k + j], open, ex, ey);
+        for (int t = 0; t < 2; t++)
+            if (c->twins[2 * i + t] >= 0) hpa_relax(p, node, c->twins[2 * i + t], PATH_STRAIGHT, open, ex, ey);
+        if (c == gc && h->goal_dist[i] >= 0) hpa_relax(p, node, goal, h->goal_dist[i], open, ex, ey);
+    }
+    if (!found) return -1;
+
+    int count = 1;
+    for (int n = goal; p->parent[n] >= 0; n = p->parent[n]) count++;
+    if (waypoints && max >= count) {
+        int i = count;
+        for (int n = goal; n >= 0; n = p->parent[n]) waypoints[--i] = n;
+    }
+    return count;
+}
+
+/* ===================== Field of view ===================== */
+
+// Recursive shadowcasting over the opacity bitmap. Each octant walks rows
+// outward from the viewer, keeping the visible slope window [end, start];
+// an opaque run narrows the window and recurses for the part before it.
+// The circle is cut with a per-radius table of row half-widths, cached
+// until the radius changes.
+static const int fov_octant[8][4] = {
+    { 1, 0, 0, 1 }, { 0, 1, 1, 0 }, { 0, -1, 1, 0 }, { -1, 0, 0, 1 },
+    { -1, 0, 0, -1 }, { 0, -1, -1, 0 }, { 0, 1, -1, 0 }, { 1, 0, 0, -1 },
+};
+
+static inline bool fov_opaque(const MapFov* f, const int x, const int y) {
+    if (x < 0 || y < 0 || x >= f->w || y >= f->h) return true;
+    return (f->opaque[y * f->words + (x >> 6)] >> (x & 63)) & 1;
+}
+
+static void fov_cast(const MapFov* f, uint64_t* visible, const int cx, const int cy, const int row, float start, const float end, const int radius, const int* o) {
+    if (start < end) return;
+    float next_start = start;
+    for (int j = row; j <= radius; j++) {
+        // Start at the first tile inside the window; tiles left of the
+        // circle are never lit and only shadow tiles outside it.
+        bool blocked = false;
+        const int reach = f->span[j];
+        int first = (int)floorf(-start * (j + 0.5f) - 0.5f) - 1;
+        if (first < -reach) first = -reach;
+        if (first < -j) first = -j;
+        for (int dx = first; dx <= 0; dx++) {
+            const float left = (dx - 0.5f) / (-j + 0.5f);
+            const float right = (dx + 0.5f) / (-j - 0.5f);
+            if (start < right) continue;
+            if (end > left) break;
+
+            const int x = cx + dx * o[0] - j * o[1];
+            const int y = cy + dx * o[2] - j * o[3];
+            if (x >= 0 && y >= 0 && x < f->w && y < f->h)
+                visible[y * f->words + (x >> 6)] |= 1ULL << (x & 63);
+
+            const bool opaque = fov_opaque(f, x, y);
+            if (blocked) {
+                if (opaque) {
+                    next_start = right;
+                    continue;
+                }
+                blocked = false;
+                start = next_start;
+            } else if (opaque && j < radius) {
+                blocked = true;
+                fov_cast(f, visible, cx, cy, j + 1, start, left, radius, o);
+                next_start = right;
+            }
+        }
+        if (blocked) break;
+    }
+}
+
+MapFov xmfov_new(const Map map, const char* opaque) {
+    unsigned char block[256];
+    memset(block, 0, 256);
+    block['#'] = 1;
+    if (opaque)
+        for (; *opaque; opaque++) block[(unsigned char)*opaque] = 1;
+
+    MapFov f;
+    zero(f);
+    f.w = map.w;
+    f.h = map.h;
+    f.words = (map.w + 63) / 64;
+    f.opaque = (uint64_t*)mcalloc((size_t)f.words * map.h, sizeof(uint64_t));
+    f.radius = -1;
+    for (int y = 0; y < map.h; y++)
+        for (int x = 0; x < map.w; x++)
+            if (block[(unsigned char)map.walling[y][x]])
+                f.opaque[y * f.words + (x >> 6)] |= 1ULL << (x & 63);
+    return f;
+}
+
+void xmfov_set(MapFov* f, const int x, const int y, const bool opaque) {
+    uint64_t* word = &f->opaque[y * f->words + (x >> 6)];
+    if (opaque) *word |= 1ULL << (x & 63);
+    else *word &= ~(1ULL << (x & 63));
+}
+
+void xmfov_free(MapFov* f) {
+    mfree(f->opaque);
+    mfree(f->span);
+    zero(*f);
+}
+
+void xmfov(MapFov* f, const int x, const int y, int radius, uint64_t* visible) {
+    memset(visible, 0, (size_t)f->words * f->h * sizeof(uint64_t));
+    if (x < 0 || y < 0 || x >= f->w || y >= f->h) return;
+    if (radius <= 0) radius = f->w + f->h;
+    if (radius != f->radius) {
+        f->span = (int*)mrealloc(f->span, (radius + 1) * sizeof(int));
+        const float r = radius + 0.5f;
+        for (int j = 0; j <= radius; j++) f->span[j] = (int)sqrtf(r * r - (float)j * j);
+        f->radius = radius;
+    }
+    visible[y * f->words + (x >> 6)] |= 1ULL << (x & 63);
+    for (int o = 0; o < 8; o++)
+        fov_cast(f, visible, x, y, 1, 1.0f, 0.0f, radius, fov_octant[o]);
+}
+
+void xmfov_batch(MapFov* f, const int* viewers, const int n, const int radius, uint64_t* visible) {
+    const size_t slice = (size_t)f->words * f->h;
+    for (int i = 0; i < n; i++)
+        xmfov(f, viewers[i] % f->w, viewers[i] / f->w, radius, visible + i * slice);
+}
+
+
+/* ===================== Map files ===================== */
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define MAP_MMAP
+#endif
+
+#define FILE_HEADER 64
+#define FILE_VERSION 1
+
+static void file_put(unsigned char* at, uint64_t v, const int bytes) {
+    for (int i = 0; i < bytes; i++, v >>= 8) at[i] = v & 0xFF;
+}
+
+static uint64_t file_get(const unsigned char* at, const int bytes) {
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--) v = v << 8 | at[i];
+    return v;
+}
+
+static int file_bits(const int colours) {
+    return colours <= 2 ? 1 : colours <= 4 ? 2 : colours <= 16 ? 4 : 8;
+}
+
+// Encodes one row into out and returns its length. RLE runs are an index
+// byte and the run length as a little-endian base-128 varint.
+static size_t file_row(const unsigned char* index, const char* row, const int w, const int encoding, const int bits, unsigned char* out) {
+    if (encoding == MAP_SAVE_PACKED) {
+        const size_t bytes = ((size_t)w * bits + 7) / 8;
+        memset(out, 0, bytes);
+        for (int x = 0; x < w; x++) {
+            const size_t bit = (size_t)x * bits;
+            out[bit >> 3] |= index[(unsigned char)row[x]] << (bit & 7);
+        }
+        return bytes;
+    }
+    size_t n = 0;
+    for (int x = 0; x < w;) {
+        int run = 1;
+        while (x + run < w && row[x + run] == row[x]) run++;
+        out[n++] = index[(unsigned char)row[x]];
+        for (unsigned v = run; ; v >>= 7) {
+            out[n++] = (v & 0x7F) | (v > 0x7F ? 0x80 : 0);
+            if (v <= 0x7F) break;
+        }
+        x += run;
+    }
+    return n;
+}
+
+bool xmsave(const Map map, const char* path, int encoding, const char* generator, const unsigned seed) {
+    if (encoding < MAP_SAVE_AUTO || encoding > MAP_SAVE_RLE) return false;
+    bool used[256] = { false };
+    for (int y = 0; y < map.h; y++)
+        for (int x = 0; x < map.w; x++) used[(unsigned char)map.walling[y][x]] = true;
+    unsigned char palette[256];
+    unsigned char index[256];
+    int colours = 0;
+    for (int c = 0; c < 256; c++)
+        if (used[c]) {
+            index[c] = colours;
+            palette[colours++] = c;
+        }
+    const int bits = file_bits(colours);
+
+    // A row never takes more than 6 bytes per tile, even as RLE.
+    unsigned char* row = toss(unsigned char, 6 * (size_t)map.w + 8);
+    if (encoding == MAP_SAVE_AUTO) {
+        size_t rle = 0;
+        for (int y = 0; y < map.h; y++) rle += file_row(index, map.walling[y], map.w, MAP_SAVE_RLE, bits, row);
+        encoding = rle < ((size_t)map.w * bits + 7) / 8 * map.h ? MAP_SAVE_RLE : MAP_SAVE_PACKED;
+    }
+
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        mfree(row);
+        return false;
+    }
+    // Raw rows start on a 64 byte boundary so a mapping can use them in place.
+    const size_t data = (FILE_HEADER + colours + 63) / 64 * 64;
+    unsigned char header[FILE_HEADER] = { 'X', 'M', 'A', 'P' };
+    file_put(header + 4, FILE_VERSION, 2);
+    header[6] = encoding;
+    header[7] = encoding == MAP_SAVE_PACKED ? bits : 0;
+    file_put(header + 8, map.w, 4);
+    file_put(header + 12, map.h, 4);
+    file_put(header + 16, seed, 4);
+    file_put(header + 20, colours, 2);
+    if (generator) strncpy((char*)header + 24, generator, 23);
+    file_put(header + 48, xmhash(map), 8);
+    file_put(header + 56, data, 8);
+    fwrite(header, 1, FILE_HEADER, f);
+    fwrite(palette, 1, colours, f);
+    for (size_t pad = FILE_HEADER + colours; pad < data; pad++) fputc(0, f);
+
+    for (int y = 0; y < map.h; y++) {
+        if (encoding == MAP_SAVE_RAW) fwrite(map.walling[y], 1, map.w, f);
+        else fwrite(row, 1, file_row(index, map.walling[y], map.w, encoding, bits, row), f);
+    }
+    mfree(row);
+    const bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
+
+// Decodes packed or RLE rows from [at, end) into map; false if malformed.
+static bool file_decode(const unsigned char* at, const unsigned char* end, const Map map, const unsigned char* palette,
+                        const int colours, const int encoding, const int bits) {
+    for (int y = 0; y < map.h; y++) {
+        char* row = map.walling[y];
+        if (encoding == MAP_SAVE_PACKED) {
+            const size_t bytes = ((size_t)map.w * bits + 7) / 8;
+            if ((size_t)(end - at) < bytes) return false;
+            const int mask = (1 << bits) - 1;
+            for (int x = 0; x < map.w; x++) {
+                const size_t bit = (size_t)x * bits;
+                const int i = at[bit >> 3] >> (bit & 7) & mask;
+                if (i >= colours) return false;
+                row[x] = palette[i];
+            }
+            at += bytes;
+            continue;
+        }
+        for (int x = 0; x < map.w;) {
+            if (at >= end || *at >= colours) return false;
+            const char tile = palette[*at++];
+            uint64_t run = 0;
+            for (int shift = 0; ; shift += 7) {
+                if (at >= end || shift > 28) return false;
+                run |= (uint64_t)(*at & 0x7F) << shift;
+                if (!(*at++ & 0x80)) break;
+            }
+            if (run == 0 || run > (uint64_t)(map.w - x)) return false;
+            memset(row + x, tile, run);
+            x += run;
+        }
+    }
+    return true;
+}
+
+MapFile xmload(const char* path, const bool verify) {
+    MapFile file;
+    zero(file);
+    unsigned char* base = NULL;
+    size_t size = 0;
+    bool mapped = false;
+#ifdef MAP_MMAP
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return file;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= FILE_HEADER) {
+        size = st.st_size;
+        // Private and writable: edits to a raw map stay in memory.
+        void* m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            base = (unsigned char*)m;
+            mapped = true;
+        }
+    }
+    close(fd);
+#else
+    FILE* f = fopen(path, "rb");
+    if (!f) return file;
+    fseek(f, 0, SEEK_END);
+    const long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (length >= FILE_HEADER) {
+        size = length;
+        base = toss(unsigned char, size);
+        if (fread(base, 1, size, f) != size) {
+            mfree(base);
+            base = NULL;
+        }
+    }
+    fclose(f);
+#endif
+    if (!base) return file;
+
+    const unsigned char* end = base + size;
+    const int encoding = base[6];
+    const int bits = base[7];
+    const uint64_t w = file_get(base + 8, 4);
+    const uint64_t h = file_get(base + 12, 4);
+    const int colours = (int)file_get(base + 20, 2);
+    const uint64_t data = file_get(base + 56, 8);
+    bool ok = !memcmp(base, "XMAP", 4) && file_get(base + 4, 2) == FILE_VERSION
+           && w > 0 && h > 0 && w <= INT32_MAX && h <= INT32_MAX
+           && colours >= 1 && colours <= 256 && data >= FILE_HEADER + (uint64_t)colours && data <= size
+           && (encoding == MAP_SAVE_RAW || encoding == MAP_SAVE_RLE || (encoding == MAP_SAVE_PACKED && bits == file_bits(colours)))
+           && (encoding != MAP_SAVE_RAW || w * h <= size - data)
+           // Packed rows are whole bytes; an RLE row is at least one index and one length byte.
+           && (encoding != MAP_SAVE_PACKED || h * ((w * bits + 7) / 8) <= size - data)
+           && (encoding != MAP_SAVE_RLE || h * 2 <= size - data);
+    if (ok) {
+        file.map.w = (int)w;
+        file.map.h = (int)h;
+        if (encoding == MAP_SAVE_RAW) {
+            file.map.walling = toss(char*, h);
+            for (uint64_t y = 0; y < h; y++) file.map.walling[y] = (char*)base + data + y * w;
+        } else {
+            file.map.walling = bnew((int)h, (int)w, '#');
+            ok = file.map.walling && file_decode(base + data, end, file.map, base + FILE_HEADER, colours, encoding, bits);
+        }
+        if (ok && verify) ok = xmhash(file.map) == file_get(base + 48, 8);
+        if (!ok && encoding == MAP_SAVE_RAW) mfree(file.map.walling);
+        else if (!ok) xmclose(file.map);
+    }
+    if (ok) {
+        memcpy(file.generator, base + 24, 23);
+        file.seed = (unsigned)file_get(base + 16, 4);
+        file.encoding = encoding;
+    }
+    if (ok && encoding == MAP_SAVE_RAW) {
+        file.base = base;
+        file.size = size;
+        return file;
+    }
+#ifdef MAP_MMAP
+    if (mapped) munmap(base, size);
+#else
+    (void)mapped;
+    mfree(base);
+#endif
+    if (!ok) zero(file);
+    return file;
+}
+
+void xmunload(MapFile* file) {
+    if (file->base) {
+        mfree(file->map.walling);
+#ifdef MAP_MMAP
+        munmap(file->base, file->size);
+#else
+        mfree(file->base);
+#endif
+    }
+    else if (file->map.walling) xmclose(file->map);
+    zero(*file);
+}
+
+
+/* ===================== Mapped maps ===================== */
+
+MappedMap xmopen_mapped(const char* path, const int w, const int h) {
+    MappedMap m;
+    zero(m);
+#ifdef MAP_MMAP
+    if (w <= 0 || h <= 0) return m;
+    const int bw = (w + MAP_BLOCK - 1) / MAP_BLOCK;
+    const int bh = (h + MAP_BLOCK - 1) / MAP_BLOCK;
+    const size_t size = (size_t)bw * bh * MAP_BLOCK * MAP_BLOCK;
+    const int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return m;
+    // Grown by writing its last byte: ftruncate is not declared under
+    // strict -std=c99, which the emcc build uses.
+    struct stat st;
+    if (fstat(fd, &st) == 0 && ((size_t)st.st_size >= size
+        || (lseek(fd, (off_t)size - 1, SEEK_SET) >= 0 && write(fd, "", 1) == 1))) {
+        void* tiles = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (tiles != MAP_FAILED) {
+            m.tiles = (char*)tiles;
+            m.size = size;
+            m.w = w;
+            m.h = h;
+            m.bw = bw;
+            m.bh = bh;
+        }
+    }
+    close(fd);
+#else
+    (void)path;
+    (void)w;
+    (void)h;
+#endif
+    return m;
+}
+
+void xmclose_mapped(MappedMap* m) {
+#ifdef MAP_MMAP
+    if (m->tiles) munmap(m->tiles, m->size);
+#endif
+    zero(*m);
+}
+
+// Row y of the window [x, x + n) in and out of a plain buffer, one block
+// segment per copy.
+static void mapped_row(const MappedMap* m, const int x, const int y, const int n, char* row, const bool store) {
+    for (int at = x; at < x + n;) {
+        const int run = MAP_BLOCK - at % MAP_BLOCK < x + n - at ? MAP_BLOCK - at % MAP_BLOCK : x + n - at;
+        char* tiles = xmmapped_at(m, at, y);
+        if (store) memcpy(tiles, row + at - x, run);
+        else memcpy(row + at - x, tiles, run);
+        at += run;
+    }
+}
+
+void xmmapped_blit(MappedMap* m, const Map map, const int x, const int y) {
+    const int x0 = x < 0 ? 0 : x;
+    const int x1 = x + map.w > m->w ? m->w : x + map.w;
+    for (int row = y < 0 ? 0 : y; row < y + map.h && row < m->h; row++)
+        if (x0 < x1) mapped_row(m, x0, row, x1 - x0, map.walling[row - y] + x0 - x, true);
+}
+
+void xmmapped_read(const MappedMap* m, const Map map, const int x, const int y) {
+    const int x0 = x < 0 ? 0 : x;
+    const int x1 = x + map.w > m->w ? m->w : x + map.w;
+    for (int row = y < 0 ? 0 : y; row < y + map.h && row < m->h; row++)
+        if (x0 < x1) mapped_row(m, x0, row, x1 - x0, map.walling[row - y] + x0 - x, false);
+}
+
+void xmmapped_generate(MappedMap* m, const MapGenerator* generator, const float* params, int chunk, const unsigned seed) {
+    chunk = chunk < MAP_BLOCK ? MAP_BLOCK : (chunk + MAP_BLOCK - 1) / MAP_BLOCK * MAP_BLOCK;
+    const int cw = (m->w + chunk - 1) / chunk;
+    const int ch = (m->h + chunk - 1) / chunk;
+    // Edge chunks are generated at full size and clipped.
+    for (int cy = 0; cy < ch; cy++)
+        for (int cx = 0; cx < cw; cx++) {
+            xmseed(seed + cy * cw + cx);
+            const Map map = xmgenerate(generator, chunk, chunk, params);
+            xmmapped_blit(m, map, cx * chunk, cy * chunk);
+            xmclose(map);
+        }
+}
+
+void xmmapped_noise(MappedMap* m, const float wall_percent, const unsigned seed) {
+    // One RNG stream per block, so any block can be redone on its own.
+    for (int by = 0; by < m->bh; by++)
+        for (int bx = 0; bx < m->bw; bx++) {
+            rng_seed(seed + by * m->bw + bx);
+            char* tiles = xmmapped_at(m, bx * MAP_BLOCK, by * MAP_BLOCK);
+            for (int y = by * MAP_BLOCK; y < (by + 1) * MAP_BLOCK; y++)
+                for (int x = bx * MAP_BLOCK; x < (bx + 1) * MAP_BLOCK; x++, tiles++) {
+                    const bool wall = (float)mrand() / MAP_RAND_MAX < wall_percent;
+                    *tiles = x == 0 || y == 0 || x >= m->w - 1 || y >= m->h - 1 || wall ? '#' : ' ';
+                }
+        }
+}
+
+// Same rule as xmgen_cellular. Old rows rotate through a three row buffer:
+// row y + 1 is read before row y is written back over the mapping.
+void xmmapped_step(MappedMap* m) {
+    const int w = m->w;
+    const int h = m->h;
+    if (w <= 0 || h <= 0) return;
+    MAP_STAT(ca_iterations, 1);
+    MAP_STAT(cells_visited, (long)w * h);
+    char* old = toss(char, 3 * (size_t)w);
+    char* next = toss(char, w);
+    unsigned char* column = toss(unsigned char, w);
+    mapped_row(m, 0, 0, w, old, false);
+    for (int y = 0; y < h; y++) {
+        if (y + 1 < h) mapped_row(m, 0, y + 1, w, old + (size_t)((y + 1) % 3) * w, false);
+        if (y == 0 || y == h - 1) {
+            memset(next, '#', w);
+            mapped_row(m, 0, y, w, next, true);
+            continue;
+        }
+        const char* above = old + (size_t)((y - 1) % 3) * w;
+        const char* row = old + (size_t)(y % 3) * w;
+        const char* below = old + (size_t)((y + 1) % 3) * w;
+        for (int x = 0; x < w; x++) column[x] = (above[x] == '#') + (row[x] == '#') + (below[x] == '#');
+        next[0] = next[w - 1] = '#';
+        for (int x = 1; x < w - 1; x++) {
+            const int walls = column[x - 1] + column[x] + column[x + 1] - (row[x] == '#');
+            next[x] = row[x] == '#' ? (walls < 4 ? ' ' : '#') : (walls > 4 ? '#' : ' ');
+        }
+        mapped_row(m, 0, y, w, next, true);
+    }
+    mfree(column);
+    mfree(next);
+    mfree(old);
+}
+
+/* ===================== Map deltas ===================== */
+
+// Spans closer than this merge: a new span header costs at least two bytes.
+#define MAP_DIFF_GAP 3
+
+static size_t diff_put(unsigned char* buf, const size_t cap, size_t n, uint64_t v) {
+    do {
+        const unsigned char byte = (v & 0x7F) | (v > 0x7F ? 0x80 : 0);
+        if (n < cap) buf[n] = byte;
+        n++;
+        v >>= 7;
+    } while (v);
+    return n;
+}
+
+static bool diff_get(const unsigned char* buf, const size_t size, size_t* n, uint64_t* v) {
+    *v = 0;
+    for (int shift = 0; shift < 64 && *n < size; shift += 7) {
+        const unsigned char byte = buf[(*n)++];
+        *v |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Copies row-major tiles [start, end) of map out to flat, or in from it.
+static void diff_copy(const Map map, uint64_t start, const uint64_t end, unsigned char* flat, const bool in) {
+    while (start < end) {
+        const int y = (int)(start / map.w);
+        const int x = (int)(start % map.w);
+        const size_t n = end - start < (uint64_t)(map.w - x) ? (size_t)(end - start) : (size_t)(map.w - x);
+        if (in) memcpy(map.walling[y] + x, flat, n);
+        else memcpy(flat, map.walling[y] + x, n);
+        flat += n;
+        start += n;
+    }
+}
+
+static size_t diff_span(const Map b, unsigned char* buf, const size_t cap, size_t n,
+                        const uint64_t last, const uint64_t start, const uint64_t end) {
+    n = diff_put(buf, cap, n, start - last);
+    n = diff_put(buf, cap, n, end - start);
+    if (n + (end - start) <= cap) diff_copy(b, start, end, buf + n, false);
+    return n + (end - start);
+}
+
+static inline uint64_t diff_word(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+size_t xmdiff(const Map a, const Map b, unsigned char* buf, const size_t cap) {
+    if (a.w != b.w || a.h != b.h) return 0;
+    size_t n = diff_put(buf, cap, 0, b.w);
+    n = diff_put(buf, cap, n, b.h);
+    // last ends the previous span, [start, end) is the open one.
+    uint64_t last = 0, start = 0, end = 0;
+    bool open = false;
+    for (int y = 0; y < b.h; y++) {
+        const char* ra = a.walling[y];
+        const char* rb = b.walling[y];
+        if (!memcmp(ra, rb, b.w)) continue;
+        int x = 0;
+        while (x < b.w) {
+            if (x + 8 <= b.w && diff_word(ra + x) == diff_word(rb + x)) {
+                x += 8;
+                continue;
+            }
+            if (ra[x] == rb[x]) {
+                x++;
+                continue;
+            }
+            const uint64_t i = (uint64_t)y * b.w + x;
+            if (open && i - end <= MAP_DIFF_GAP) end = i + 1;
+            else {
+                if (open) n = diff_span(b, buf, cap, n, last, start, end);
+                last = end;
+                start = i;
+                end = i + 1;
+                open = true;
+            }
+            x++;
+        }
+    }
+    if (open) n = diff_span(b, buf, cap, n, last, start, end);
+    return n;
+}
+
+// Walks the spans of a delta, copying them into map when apply is set.
+static bool diff_walk(const Map map, const unsigned char* buf, const size_t size, const bool apply) {
+    size_t n = 0;
+    uint64_t w, h;
+    if (!diff_get(buf, size, &n, &w) || !diff_get(buf, size, &n, &h)) return false;
+    if (w != (uint64_t)map.w || h != (uint64_t)map.h) return false;
+    const uint64_t tiles = w * h;
+    uint64_t end = 0;
+    while (n < size) {
+        uint64_t gap, len;
+        if (!diff_get(buf, size, &n, &gap) || !diff_get(buf, size, &n, &len)) return false;
+        if (gap > tiles - end || len > tiles - end - gap || len > size - n) return false;
+        if (apply) diff_copy(map, end + gap, end + gap + len, (unsigned char*)buf + n, true);
+        end += gap + len;
+        n += len;
+    }
+    return true;
+}
+
+bool xmpatch(const Map map, const unsigned char* buf, const size_t size) {
+    if (!diff_walk(map, buf, size, false)) return false;
+    return diff_walk(map, buf, size, true);
+}
+
+/* ===================== Run-length maps ===================== */
+
+MapRle xmrle(const Map map) {
+    MapRle rle;
+    zero(rle);
+    if (map.w > UINT16_MAX) return rle;
+    int count = 0;
+    for (int y = 0; y < map.h; y++)
+        for (int x = 0; x < map.w; x++)
+            count += x == 0 || map.walling[y][x] != map.walling[y][x - 1];
+    rle.w = map.w;
+    rle.h = map.h;
+    rle.count = count;
+    rle.row = (int*)mmalloc((map.h + 1) * sizeof(int) + (size_t)count * (sizeof(uint16_t) + 1));
+    rle.end = (uint16_t*)(rle.row + map.h + 1);
+    rle.tile = (char*)(rle.end + count);
+    int run = 0;
+    for (int y = 0; y < map.h; y++) {
+        const char* row = map.walling[y];
+        rle.row[y] = run;
+        for (int x = 0; x < map.w; x++) {
+            if (x > 0 && row[x] == row[x - 1]) continue;
+            if (x > 0) rle.end[run - 1] = x;
+            rle.tile[run++] = row[x];
+        }
+        if (map.w > 0) rle.end[run - 1] = map.w;
+    }
+    rle.row[map.h] = run;
+    return rle;
+}
+
+void xmrle_row(const MapRle* rle, const int y, char* out) {
+    int x = 0;
+    for (int i = rle->row[y]; i < rle->row[y + 1]; i++) {
+        memset(out + x, rle->tile[i], rle->end[i] - x);
+        x = rle->end[i];
+    }
+}
+
+Map xmrle_expand(const MapRle* rle) {
+    Map map = mnew(rle->h, rle->w);
+    for (int y = 0; y < rle->h; y++) xmrle_row(rle, y, map.walling[y]);
+    return map;
+}
+
+char xmrle_at(const MapRle* rle, const int x, const int y) {
+    // First run of the row that ends after x.
+    int lo = rle->row[y];
+    int hi = rle->row[y + 1] - 1;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (rle->end[mid] > x) hi = mid;
+        else lo = mid + 1;
+    }
+    return rle->tile[lo];
+}
+
+long xmrle_count(const MapRle* rle, const char tile) {
+    long count = 0;
+    for (int y = 0; y < rle->h; y++) {
+        int x = 0;
+        for (int i = rle->row[y]; i < rle->row[y + 1]; i++) {
+            if (rle->tile[i] == tile) count += rle->end[i] - x;
+            x = rle->end[i];
+        }
+    }
+    return count;
+}
+
+size_t xmrle_bytes(const MapRle* rle) {
+    return sizeof(MapRle) + (rle->h + 1) * sizeof(int) + (size_t)rle->count * (sizeof(uint16_t) + 1);
+}
+
+void xmrle_free(MapRle* rle) {
+    mfree(rle->row);
+    zero(*rle);
+}
+
+#ifdef MAP_THREADS
+/* ===================== Background generation ===================== */
+
+static void* worker_main(void* arg) {
+    MapWorker* worker = (MapWorker*)arg;
+    pthread_mutex_lock(&worker->lock);
+    for (;;) {
+        while (!worker->pending && !worker->quit) pthread_cond_wait(&worker->wake, &worker->lock);
+        if (worker->quit) break;
+        const MapGenerator* generator = worker->generator;
+        float params[MAP_GENERATOR_PARAMS];
+        memcpy(params, worker->params, sizeof(params));
+        const int w = worker->w, h = worker->h;
+        const unsigned seed = worker->seed;
+        pthread_mutex_unlock(&worker->lock);
+
+        xmseed(seed);
+        Map map = xmgenerate(generator, w, h, params);
+        void* extra = worker->finish ? worker->finish(&map, worker->user) : NULL;
+
+        pthread_mutex_lock(&worker->lock);
+        worker->result = map;
+        worker->extra = extra;
+        worker->pending = false;
+        atomic_store_explicit(&worker->ready, true, memory_order_release);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+void xmworker_start(MapWorker* worker, MapWorkerFinish finish, void* user) {
+    zero(*worker);
+    worker->finish = finish;
+    worker->user = user;
+    atomic_init(&worker->ready, false);
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->wake, NULL);
+    if (pthread_create(&worker->thread, NULL, worker_main, worker)) bomb("xmworker_start: pthread_create");
+}
+
+// False while a request runs or its result has not been taken.
+bool xmworker_request(MapWorker* worker, const MapGenerator* generator, const int w, const int h,
+                      const float* params, const unsigned seed) {
+    pthread_mutex_lock(&worker->lock);
+    const bool idle = !worker->pending && !atomic_load(&worker->ready);
+    if (idle) {
+        worker->generator = generator;
+        memcpy(worker->params, params ? params : generator->defaults, sizeof(worker->params));
+        worker->w = w;
+        worker->h = h;
+        worker->seed = seed;
+        worker->pending = true;
+        pthread_cond_signal(&worker->wake);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return idle;
+}
+
+bool xmworker_busy(MapWorker* worker) {
+    pthread_mutex_lock(&worker->lock);
+    const bool busy = worker->pending;
+    pthread_mutex_unlock(&worker->lock);
+    return busy;
+}
+
+bool xmworker_poll(MapWorker* worker, Map* map, void** extra) {
+    if (!atomic_load_explicit(&worker->ready, memory_order_acquire)) return false;
+    *map = worker->result;
+    if (extra) *extra = worker->extra;
+    atomic_store_explicit(&worker->ready, false, memory_order_release);
+    return true;
+}
+
+// Waits for a running request; a map nobody took is freed, with its extra.
+void xmworker_stop(MapWorker* worker) {
+    pthread_mutex_lock(&worker->lock);
+    worker->quit = true;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+    pthread_join(worker->thread, NULL);
+    if (atomic_load(&worker->ready)) {
+        xmclose(worker->result);
+        if (worker->drop) worker->drop(worker->extra);
+    }
+    pthread_cond_destroy(&worker->wake);
+    pthread_mutex_destroy(&worker->lock);
+}
+
+/* ===================== Map pools ===================== */
+
+static size_t pool_map_bytes(const MapPoolSlot* slot) {
+    return slot->h * sizeof(char*) + (size_t)slot->w * slot->h;
+}
+
+// What a refill of the slot is expected to hold: the map and an extra
+// the size of the last one.
+static size_t pool_slot_bytes(const MapPoolSlot* slot) {
+    return pool_map_bytes(slot) + slot->extra_bytes;
+}
+
+// Runs a slot's generator with seed, leaving the calling thread's own
+// xmseed setting as it was.
+static Map pool_generate(MapPool* pool, const MapPoolSlot* slot, const unsigned seed, void** extra) {
+    const unsigned old_seed = map_seed;
+    const bool old_seeded = map_seeded;
+    xmseed(seed);
+    Map map = xmgenerate(slot->generator, slot->w, slot->h, slot->params);
+    map_seed = old_seed;
+    map_seeded = old_seeded;
+    *extra = pool->finish ? pool->finish(&map, pool->user) : NULL;
+    return map;
+}
+
+// The emptiest slot that is short of depth and fits the budget, or -1.
+static int pool_pick(MapPool* pool) {
+    int best = -1;
+    for (int i = 0; i < pool->slot_count; i++) {
+        const MapPoolSlot* slot = &pool->slots[i];
+        const int have = slot->count + slot->filling;
+        if (have >= pool->depth || pool->bytes + pool_slot_bytes(slot) > pool->cap) continue;
+        if (best < 0 || have < pool->slots[best].count + pool->slots[best].filling) best = i;
+    }
+    return best;
+}
+
+static double pool_ms(void) {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static void* pool_main(void* arg) {
+    MapPool* pool = (MapPool*)arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        int i = -1;
+        while (!pool->quit && (i = pool_pick(pool)) < 0) pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit) break;
+        MapPoolSlot* slot = &pool->slots[i];
+        slot->filling++;
+        const size_t reserved = pool_slot_bytes(slot);
+        pool->bytes += reserved;
+        const MapPoolSlot job = *slot;
+        const unsigned seed = pool->seed++;
+        pthread_mutex_unlock(&pool->lock);
+
+        const double start = pool_ms();
+        void* extra;
+        const Map map = pool_generate(pool, &job, seed, &extra);
+        const double ms = pool_ms() - start;
+        const size_t extra_bytes = pool->measure && extra ? pool->measure(extra) : 0;
+
+        pthread_mutex_lock(&pool->lock);
+        slot = &pool->slots[i];
+        const int at = (slot->head + slot->count) % pool->depth;
+        slot->ready[at] = map;
+        slot->extras[at] = extra;
+        slot->sizes[at] = pool_map_bytes(slot) + extra_bytes;
+        slot->extra_bytes = extra_bytes;
+        pool->bytes = pool->bytes - reserved + slot->sizes[at];
+        slot->count++;
+        slot->filling--;
+        pool->stats.refills++;
+        pool->refill_total_ms += ms;
+        if (ms > pool->stats.refill_max_ms) pool->stats.refill_max_ms = ms;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void xmpool_init(MapPool* pool, const int depth, const size_t cap, const unsigned seed, MapWorkerFinish finish, void* user) {
+    zero(*pool);
+    pool->depth = depth < 1 ? 1 : depth;
+    pool->cap = cap;
+    pool->seed = seed;
+    pool->finish = finish;
+    pool->user = user;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+}
+
+// Returns the slot index for xmpool_try and xmpool_take.
+int xmpool_add(MapPool* pool, const MapGenerator* generator, const int w, const int h, const float* params) {
+    pthread_mutex_lock(&pool->lock);
+    pool->slots = (MapPoolSlot*)mrealloc(pool->slots, (pool->slot_count + 1) * sizeof(MapPoolSlot));
+    MapPoolSlot* slot = &pool->slots[pool->slot_count];
+    zero(*slot);
+    slot->generator = generator;
+    memcpy(slot->params, params ? params : generator->defaults, sizeof(slot->params));
+    slot->w = w;
+    slot->h = h;
+    slot->ready = toss(Map, pool->depth);
+    slot->extras = toss(void*, pool->depth);
+    slot->sizes = toss(size_t, pool->depth);
+    const int index = pool->slot_count++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    return index;
+}
+
+void xmpool_start(MapPool* pool, const int threads) {
+    pool->thread_count = threads < 1 ? 1 : threads;
+    pool->threads = toss(pthread_t, pool->thread_count);
+    for (int t = 0; t < pool->thread_count; t++)
+        if (pthread_create(&pool->threads[t], NULL, pool_main, pool)) bomb("xmpool_start: pthread_create");
+}
+
+bool xmpool_try(MapPool* pool, const int slot, Map* map, void** extra) {
+    pthread_mutex_lock(&pool->lock);
+    MapPoolSlot* s = &pool->slots[slot];
+    const bool hit = s->count > 0;
+    if (hit) {
+        *map = s->ready[s->head];
+        if (extra) *extra = s->extras[s->head];
+        pool->bytes -= s->sizes[s->head];
+        s->head = (s->head + 1) % pool->depth;
+        s->count--;
+        pool->stats.hits++;
+        pthread_cond_signal(&pool->wake);
+    }
+    else pool->stats.misses++;
+    pthread_mutex_unlock(&pool->lock);
+    return hit;
+}
+
+Map xmpool_take(MapPool* pool, const int slot, void** extra) {
+    Map map;
+    void* ignored;
+    if (xmpool_try(pool, slot, &map, extra ? extra : &ignored)) {
+        if (!extra && pool->drop) pool->drop(ignored);
+        return map;
+    }
+    pthread_mutex_lock(&pool->lock);
+    const MapPoolSlot job = pool->slots[slot];
+    const unsigned seed = pool->seed++;
+    pthread_mutex_unlock(&pool->lock);
+    map = pool_generate(pool, &job, seed, extra ? extra : &ignored);
+    if (!extra && pool->drop) pool->drop(ignored);
+    return map;
+}
+
+void xmpool_stats(MapPool* pool, MapPoolStats* stats) {
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    stats->refill_ms = stats->refills ? pool->refill_total_ms / stats->refills : 0;
+    stats->ready = 0;
+    for (int i = 0; i < pool->slot_count; i++) stats->ready += pool->slots[i].count;
+    stats->bytes = pool->bytes;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Joins the threads once their running refills finish and frees every
+// map still pooled.
+void xmpool_stop(MapPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int t = 0; t < pool->thread_count; t++) pthread_join(pool->threads[t], NULL);
+    for (int i = 0; i < pool->slot_count; i++) {
+        MapPoolSlot* slot = &pool->slots[i];
+        for (int k = 0; k < slot->count; k++) {
+            const int at = (slot->head + k) % pool->depth;
+            xmclose(slot->ready[at]);
+            if (pool->drop) pool->drop(slot->extras[at]);
+        }
+        mfree(slot->ready);
+        mfree(slot->extras);
+        mfree(slot->sizes);
+    }
+    mfree(pool->slots);
+    mfree(pool->threads);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    zero(*pool);
+}
+#endif
+
 #endif
@@ -0,0 +1,313 @@
+// Headless benchmark for every generator in xmgenerators.
+//
+//   make bench
+//   ./map_bench [--gen NAME] [--max-size N] [--runs N] [--budget SEC] [--json FILE]
+//   ./map_bench --record golden.txt | --verify golden.txt [--gen NAME]
+//
+// Each generator/size case runs in a forked child so peak RSS and a crash
+// or timeout stay local to it. Run i of every case uses seed 1000 + i.
+//
+// --record writes xmhash of every generator at a few sizes and seeds,
+// --verify regenerates them and fails on any difference, so an optimized
+// build can be checked against maps from the reference one.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+static long bench_allocs;
+
+static void* bench_malloc(size_t n) { bench_allocs++; return malloc(n); }
+static void* bench_calloc(size_t c, size_t n) { bench_allocs++; return calloc(c, n); }
+static void* bench_realloc(void* p, size_t n) { if (!p) bench_allocs++; return realloc(p, n); }
+
+#define MAP_MALLOC(n) bench_malloc(n)
+#define MAP_CALLOC(c, n) bench_calloc(c, n)
+#define MAP_REALLOC(p, n) bench_realloc(p, n)
+#define MAP_FREE(p) free(p)
+
+#define MAP_IMPLEMENTATION
+#include "Map.h"
+
+#define MAX_RUNS 1000
+
+typedef struct
+{
+    int w;
+    int h;
+}
+Size;
+
+static const Size sizes[] = {
+    {   80,  100 },
+    {  256,  256 },
+    {  512,  512 },
+    { 1024, 1024 },
+    { 2048, 2048 },
+    { 4096, 4096 },
+};
+static const int size_count = sizeof(sizes) / sizeof(sizes[0]);
+
+// What a child reports back through its pipe.
+typedef struct
+{
+    int runs;
+    long allocs;
+    double ns[MAX_RUNS];
+}
+Sample;
+
+typedef struct
+{
+    const char* gen;
+    int w;
+    int h;
+    int runs;
+    double median;
+    double p99;
+    double ns_tile;
+    long allocs;
+    long rss_kb;
+    const char* status;
+}
+Result;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    const double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void run_case(const MapGenerator* g, const Size s, const int min_runs,
+                     const double budget, Sample* out) {
+    const double start = now();
+    long allocs = 0;
+    int runs = 0;
+    while (runs < MAX_RUNS && (runs < min_runs || now() - start < budget * 1e9)) {
+        xmseed(1000 + runs);
+        bench_allocs = 0;
+        const double t0 = now();
+        Map map = xmgenerate(g, s.w, s.h, NULL);
+        out->ns[runs] = now() - t0;
+        xmclose(map);
+        allocs += bench_allocs;
+        runs++;
+    }
+    out->runs = runs;
+    out->allocs = allocs / runs;
+}
+
+// Forks, runs the case in the child and fills r. The child is killed after
+// limit seconds.
+static void bench_case(const MapGenerator* g, const Size s, const int min_runs,
+                       const double budget, const int limit, Result* r) {
+    r->gen = g->name;
+    r->w = s.w;
+    r->h = s.h;
+    r->status = "ok";
+
+    int fd[2];
+    if (pipe(fd)) bomb("pipe");
+    const pid_t pid = fork();
+    if (pid < 0) bomb("fork");
+    if (pid == 0) {
+        close(fd[0]);
+        alarm(limit);
+        Sample* sample = malloc(sizeof(Sample));
+        run_case(g, s, min_runs, budget, sample);
+        const size_t bytes = sizeof(Sample) - sizeof(sample->ns) + sample->runs * sizeof(double);
+        if (write(fd[1], sample, bytes) != (ssize_t)bytes) _exit(1);
+        _exit(0);
+    }
+    close(fd[1]);
+
+    Sample* sample = calloc(1, sizeof(Sample));
+    size_t got = 0;
+    ssize_t n;
+    while ((n = read(fd[0], (char*)sample + got, sizeof(Sample) - got)) > 0) got += n;
+    close(fd[0]);
+
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    r->rss_kb = usage.ru_maxrss;
+
+    if (WIFSIGNALED(status)) r->status = WTERMSIG(status) == SIGALRM ? "timeout" : "crash";
+    else if (WEXITSTATUS(status) || got < sizeof(Sample) - sizeof(sample->ns)) r->status = "error";
+
+    if (!strcmp(r->status, "ok")) {
+        qsort(sample->ns, sample->runs, sizeof(double), cmp_double);
+        r->runs = sample->runs;
+        r->median = sample->ns[sample->runs / 2];
+        r->p99 = sample->ns[(int)((sample->runs - 1) * 0.99 + 0.5)];
+        r->ns_tile = r->median / ((double)s.w * s.h);
+        r->allocs = sample->allocs;
+    }
+    free(sample);
+}
+
+static void print_row(const Result* r) {
+    if (strcmp(r->status, "ok"))
+        printf("%-15s %5dx%-5d %6s\n", r->gen, r->w, r->h, r->status);
+    else
+        printf("%-15s %5dx%-5d %6d %12.3f %12.3f %10.2f %10ld %10ld\n", r->gen, r->w, r->h,
+               r->runs, r->median / 1e6, r->p99 / 1e6, r->ns_tile, r->allocs, r->rss_kb);
+    fflush(stdout);
+}
+
+static void write_json(const char* path, const Result* results, const int count) {
+    FILE* f = fopen(path, "w");
+    if (!f) { perror(path); return; }
+    fprintf(f, "[\n");
+    for (int i = 0; i < count; i++) {
+        const Result* r = &results[i];
+        fprintf(f, "  {\"generator\": \"%s\", \"w\": %d, \"h\": %d, \"status\": \"%s\"",
+                r->gen, r->w, r->h, r->status);
+        if (!strcmp(r->status, "ok"))
+            fprintf(f, ", \"runs\": %d, \"median_ms\": %.6f, \"p99_ms\": %.6f, \"ns_per_tile\": %.4f, "
+                       "\"allocs\": %ld, \"peak_rss_kb\": %ld",
+                    r->runs, r->median / 1e6, r->p99 / 1e6, r->ns_tile, r->allocs, r->rss_kb);
+        fprintf(f, "}%s\n", i + 1 < count ? "," : "");
+    }
+    fprintf(f, "]\n");
+    fclose(f);
+}
+
+static const Size golden_sizes[] = {
+    {  80, 100 },
+    { 128, 128 },
+    { 256, 256 },
+};
+static const unsigned golden_seeds[] = { 1, 2, 3 };
+
+// Returns the number of mismatches (or lines that could not be checked).
+static int golden(const char* path, const bool record, const char* only) {
+    FILE* f = fopen(path, record ? "w" : "r");
+    if (!f) { perror(path); return 1; }
+    if (record)
+        fprintf(f, "# generator w h seed xmhash, from map_bench --record (generators use Map.h's own RNG, not the libc rand())\n");
+
+    int bad = 0;
+    int cases = 0;
+    char line[256];
+    for (int g = 0; g < xmgenerator_count; g++) {
+        const MapGenerator* gen = &xmgenerators[g];
+        if (only && strcmp(gen->name, only)) continue;
+        for (int s = 0; s < (int)(sizeof(golden_sizes) / sizeof(golden_sizes[0])); s++) {
+            for (int k = 0; k < (int)(sizeof(golden_seeds) / sizeof(golden_seeds[0])); k++) {
+                const Size size = golden_sizes[s];
+                const unsigned seed = golden_seeds[k];
+                xmseed(seed);
+                const double t0 = now();
+                Map map = xmgenerate(gen, size.w, size.h, NULL);
+                const double ms = (now() - t0) / 1e6;
+                const uint64_t hash = xmhash(map);
+                xmclose(map);
+                cases++;
+
+                const char* status = "ok";
+                if (record) {
+                    fprintf(f, "%s %d %d %u %016llx\n", gen->name, size.w, size.h, seed, (unsigned long long)hash);
+                } else {
+                    // Golden lines are looked up by key, so order and extra entries do not matter.
+                    unsigned long long want = 0;
+                    bool found = false;
+                    rewind(f);
+                    while (!found && fgets(line, sizeof(line), f)) {
+                        char name[64];
+                        int w, h;
+                        unsigned sd;
+                        if (line[0] == '#' || sscanf(line, "%63s %d %d %u %llx", name, &w, &h, &sd, &want) != 5) continue;
+                        found = !strcmp(name, gen->name) && w == size.w && h == size.h && sd == seed;
+                    }
+                    if (!found) status = "missing";
+                    else if (want != hash) status = "MISMATCH";
+                    if (strcmp(status, "ok")) bad++;
+                }
+                printf("%-15s %5dx%-5d seed %-3u %016llx %10.3f ms %s\n", gen->name, size.w, size.h, seed,
+                       (unsigned long long)hash, ms, status);
+            }
+        }
+    }
+    fclose(f);
+    if (record) printf("recorded %d cases in %s\n", cases, path);
+    else printf("%d of %d cases differ from %s\n", bad, cases, path);
+    return bad;
+}
+
+static void usage(const char* self) {
+    fprintf(stderr, "usage: %s [--gen NAME] [--max-size N] [--runs N] [--budget SEC] [--json FILE]\n", self);
+    fprintf(stderr, "       %s --record FILE | --verify FILE [--gen NAME]\n", self);
+    fprintf(stderr, "generators:");
+    for (int i = 0; i < xmgenerator_count; i++) fprintf(stderr, " %s", xmgenerators[i].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    const char* only = NULL;
+    const char* json = "bench.json";
+    const char* record = NULL;
+    const char* verify = NULL;
+    int max_size = 4096;
+    int min_runs = 3;
+    double budget = 1.0;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && !strcmp(argv[i], "--gen")) only = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--max-size")) max_size = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--runs")) min_runs = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--budget")) budget = atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--json")) json = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--record")) record = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--verify")) verify = argv[++i];
+        else usage(argv[0]);
+    }
+    if (only && !xmgenerator_find(only)) usage(argv[0]);
+    if (record || verify) return golden(record ? record : verify, record != NULL, only) ? 1 : 0;
+    if (min_runs < 1) min_runs = 1;
+    if (min_runs > MAX_RUNS) min_runs = MAX_RUNS;
+
+    // A case is skipped once the previous size's median, scaled by tile
+    // count, predicts more than limit seconds for min_runs runs.
+    const int limit = (int)(budget * 30) + 10;
+    Result* results = calloc(xmgenerator_count * size_count, sizeof(Result));
+    int count = 0;
+
+    printf("%-15s %11s %6s %12s %12s %10s %10s %10s\n",
+           "generator", "size", "runs", "median ms", "p99 ms", "ns/tile", "allocs", "rss KB");
+    for (int g = 0; g < xmgenerator_count; g++) {
+        const MapGenerator* gen = &xmgenerators[g];
+        if (only && strcmp(gen->name, only)) continue;
+        double last = 0;
+        for (int s = 0; s < size_count; s++) {
+            if (sizes[s].w > max_size || sizes[s].h > max_size) break;
+            Result* r = &results[count++];
+            if (last > 0 && last * min_runs / 1e9 > limit) {
+                *r = (Result){ gen->name, sizes[s].w, sizes[s].h, 0, 0, 0, 0, 0, 0, "skipped" };
+                print_row(r);
+                last = 1e30;
+                continue;
+            }
+            bench_case(gen, sizes[s], min_runs, budget, limit, r);
+            print_row(r);
+            if (strcmp(r->status, "ok")) last = 1e30;
+            else if (s + 1 < size_count)
+                last = r->ns_tile * sizes[s + 1].w * sizes[s + 1].h;
+        }
+    }
+
+    write_json(json, results, count);
+    printf("wrote %s\n", json);
+    free(results);
+    return 0;
+}
@@ -2,92 +2,453 @@
 #include "raylib.h"
 #include <time.h>
 
+// Maps are generated on a worker thread where there are threads.
+#if !defined(__EMSCRIPTEN__) && !defined(MAP_THREADS)
+#define MAP_THREADS
+#endif
 #define MAP_IMPLEMENTATION
 #include "Map.h"
 
-#define MAP_GENS_NUMBER 17
-#define MAP_WIDTH  80
-#define MAP_HEIGHT 100
-#define MAX_ROOMS 30
-#define MIN_ROOM_SIZE 5
-#define MAX_ROOM_SIZE 20
-#define PERCENT_DRUNK 0.5
+// Map size, 80x100 unless given on the command line.
+static int mapWidth = 80;
+static int mapHeight = 100;
 
-void DrawMinimap(Map map, int posX, int posY, int cellSize)
+// Tile kinds the 3D view draws, one merged mesh each. Every tile is a unit
+// cube at its kind's height; walls are raised.
+#define TILE_KINDS 6
+static const char tileChars[TILE_KINDS] = { '#', '?', '*', '|', '"', ' ' };
+static const float tileHeights[TILE_KINDS] = { 2.0f, 0, 0, 0, 0, 0 };
+
+static int TileKind(char tile)
+{
+    if (tile == '+') tile = ' ';
+    for (int k = 0; k < TILE_KINDS; k++)
+        if (tileChars[k] == tile) return k;
+    return -1;
+}
+
+static Color TileColor(int kind)
+{
+    const Color colors[TILE_KINDS] = { DARKGRAY, BLUE, RED, ORANGE, GREEN, BROWN };
+    return kind < 0 ? BROWN : colors[kind];
+}
+
+typedef struct
+{
+    Model models[TILE_KINDS];
+    bool loaded[TILE_KINDS];
+}
+MapModels;
+
+// CPU-side geometry, built off the render thread when there are threads.
+typedef struct
+{
+    Mesh meshes[TILE_KINDS];
+}
+MapMeshes;
+
+// With mesh->vertices NULL only counts, so a mesh can be sized first.
+static void AddQuad(Mesh *mesh, Vector3 a, Vector3 b, Vector3 c, Vector3 d, Vector3 normal)
+{
+    if (mesh->vertices)
+    {
+        const Vector3 corners[6] = { a, b, c, a, c, d };
+        for (int i = 0; i < 6; i++)
+        {
+            float *v = mesh->vertices + (mesh->vertexCount + i) * 3;
+            float *n = mesh->normals + (mesh->vertexCount + i) * 3;
+            v[0] = corners[i].x; v[1] = corners[i].y; v[2] = corners[i].z;
+            n[0] = normal.x; n[1] = normal.y; n[2] = normal.z;
+        }
+    }
+    mesh->vertexCount += 6;
+    mesh->triangleCount += 2;
+}
+
+// A side is hidden when the neighbour is a tile drawn at the same level.
+static bool Covered(const signed char *kinds, int w, int h, int x, int z, float level)
 {
-    for (int y = 0; y < map.h; y++)
+    if (x < 0 || z < 0 || x >= w || z >= h) return false;
+    const int k = kinds[z * w + x];
+    return k >= 0 && tileHeights[k] == level;
+}
+
+// Greedy mesh of one tile kind, every tile a unit cube at its level: tops
+// and bottoms are maximal rectangles, sides are maximal runs along each
+// edge, and sides facing a cube at the same level are dropped.
+static void MeshKind(Mesh *mesh, const signed char *kinds, unsigned char *done, int w, int h, int k)
+{
+    const float y0 = tileHeights[k];
+    const float y1 = y0 + 1.0f;
+
+    memset(done, 0, (size_t)w * h);
+    for (int z = 0; z < h; z++)
     {
-        for (int x = 0; x < map.w; x++)
+        for (int x = 0; x < w; x++)
         {
-            char tile = map.walling[y][x];
-            Color color = BROWN;      
+            if (kinds[z * w + x] != k || done[z * w + x]) continue;
+            int rw = 1;
+            while (x + rw < w && kinds[z * w + x + rw] == k && !done[z * w + x + rw]) rw++;
+            int rh = 1;
+            for (bool grow = true; grow && z + rh < h; )
+            {
+                for (int i = 0; i < rw && grow; i++)
+                    grow = kinds[(z + rh) * w + x + i] == k && !done[(z + rh) * w + x + i];
+                if (grow) rh++;
+            }
+            for (int j = 0; j < rh; j++) memset(done + (size_t)(z + j) * w + x, 1, rw);
 
-            if (tile == '#') color = DARKGRAY;      
-            else if (tile == '?') color = BLUE;      
-            else if (tile == '*') color = RED;       
-            else if (tile == '|') color = ORANGE;     
-            else if (tile == '"') color = GREEN;      
+            const float x0 = (float)x, x1 = (float)(x + rw), z0 = (float)z, z1 = (float)(z + rh);
+            AddQuad(mesh, (Vector3){ x0, y1, z1 }, (Vector3){ x1, y1, z1 }, (Vector3){ x1, y1, z0 },
+                    (Vector3){ x0, y1, z0 }, (Vector3){ 0, 1, 0 });
+            AddQuad(mesh, (Vector3){ x0, y0, z0 }, (Vector3){ x1, y0, z0 }, (Vector3){ x1, y0, z1 },
+                    (Vector3){ x0, y0, z1 }, (Vector3){ 0, -1, 0 });
+        }
+    }
 
-            DrawRectangle(posX + x * cellSize, posY + y * cellSize, cellSize, cellSize, color);
+    // Sides facing +z and -z, run along x.
+    for (int z = 0; z < h; z++)
+    {
+        for (int side = 1; side >= -1; side -= 2)
+        {
+            for (int x = 0; x < w; )
+            {
+                if (kinds[z * w + x] != k || Covered(kinds, w, h, x, z + side, y0)) { x++; continue; }
+                int end = x + 1;
+                while (end < w && kinds[z * w + end] == k && !Covered(kinds, w, h, end, z + side, y0)) end++;
+                const float x0 = (float)x, x1 = (float)end;
+                if (side > 0)
+                {
+                    const float f = (float)(z + 1);
+                    AddQuad(mesh, (Vector3){ x0, y0, f }, (Vector3){ x1, y0, f }, (Vector3){ x1, y1, f },
+                            (Vector3){ x0, y1, f }, (Vector3){ 0, 0, 1 });
+                }
+                else
+                {
+                    const float f = (float)z;
+                    AddQuad(mesh, (Vector3){ x1, y0, f }, (Vector3){ x0, y0, f }, (Vector3){ x0, y1, f },
+                            (Vector3){ x1, y1, f }, (Vector3){ 0, 0, -1 });
+                }
+                x = end;
+            }
+        }
+    }
+
+    // Sides facing +x and -x, run along z.
+    for (int x = 0; x < w; x++)
+    {
+        for (int side = 1; side >= -1; side -= 2)
+        {
+            for (int z = 0; z < h; )
+            {
+                if (kinds[z * w + x] != k || Covered(kinds, w, h, x + side, z, y0)) { z++; continue; }
+                int end = z + 1;
+                while (end < h && kinds[end * w + x] == k && !Covered(kinds, w, h, x + side, end, y0)) end++;
+                const float z0 = (float)z, z1 = (float)end;
+                if (side > 0)
+                {
+                    const float f = (float)(x + 1);
+                    AddQuad(mesh, (Vector3){ f, y0, z1 }, (Vector3){ f, y0, z0 }, (Vector3){ f, y1, z0 },
+                            (Vector3){ f, y1, z1 }, (Vector3){ 1, 0, 0 });
+                }
+                else
+                {
+                    const float f = (float)x;
+                    AddQuad(mesh, (Vector3){ f, y0, z0 }, (Vector3){ f, y0, z1 }, (Vector3){ f, y1, z1 },
+                            (Vector3){ f, y1, z0 }, (Vector3){ -1, 0, 0 });
+                }
+                z = end;
+            }
         }
     }
 }
 
-void RegenerateDungeon(Map *map, int *what)
+// One greedy-meshed mesh per tile kind, so a frame is at most TILE_KINDS
+// draw calls however large the map is. Touches no GL state.
+static MapMeshes BuildMapMeshes(Map map)
 {
-    *what = rand() % MAP_GENS_NUMBER;
-    switch (*what)
+    MapMeshes out = { 0 };
+    const int w = map.w, h = map.h;
+    signed char *kinds = (signed char *)MemAlloc(w * h);
+    unsigned char *done = (unsigned char *)MemAlloc(w * h);
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+            kinds[y * w + x] = (signed char)TileKind(map.walling[y][x]);
+
+    for (int k = 0; k < TILE_KINDS; k++)
     {
-        case 0:  *map = xmgen_cellular(MAP_WIDTH, MAP_HEIGHT, 0.45, 1000); break;
-        case 1:  *map = xmgen(MAP_WIDTH, MAP_HEIGHT, 3+rand()%4, MAX_ROOMS); break;
-        case 2:  *map = xmgen_graph(MAP_WIDTH, MAP_HEIGHT, MAX_ROOMS, MIN_ROOM_SIZE, MAX_ROOM_SIZE, 1); break;
-        case 3:  *map = xmgen_brogue(MAP_WIDTH, MAP_HEIGHT, MAX_ROOMS, MIN_ROOM_SIZE, MAX_ROOM_SIZE); break;
-        case 4:  *map = xmgen_room_maze(MAP_WIDTH, MAP_HEIGHT, MAP_WIDTH-2, MAP_HEIGHT-2, MAX_ROOMS, MIN_ROOM_SIZE, MAX_ROOM_SIZE); break;
-        case 5:  *map = xmgen_drunk(MAP_WIDTH, MAP_HEIGHT, PERCENT_DRUNK); break;
-        case 6:  *map = xmgen_subtractive(MAP_WIDTH, MAP_HEIGHT, 20); break;
-        case 7:  *map = xmgen_perlin(MAP_WIDTH, MAP_HEIGHT, 0.1); break;
-        case 8:  *map = xmgen_maze(MAP_WIDTH, MAP_HEIGHT, MAP_WIDTH-2, MAP_HEIGHT-2); break;
-        case 9:  *map = xmgen_bsp(MAP_WIDTH, MAP_HEIGHT, MIN_ROOM_SIZE); break;
-        case 10: *map = xmgen_scatter(MAP_WIDTH, MAP_HEIGHT, MAX_ROOMS, MIN_ROOM_SIZE, MAX_ROOM_SIZE); break;
-        case 11: *map = xmgen_zorbus_like(MAP_WIDTH, MAP_HEIGHT, 500, 90); break;
-        case 12: *map = xmgen_hub(MAP_WIDTH, MAP_HEIGHT, 10, MAX_ROOMS, MIN_ROOM_SIZE, MAX_ROOM_SIZE); break;
-        case 13: *map = xmgen_winding_path(MAP_WIDTH, MAP_HEIGHT, 20000, 1, 4, 5); break;
-        case 14: *map = xmgen_cross_sections(MAP_WIDTH, MAP_HEIGHT, 5, 50); break;
-        case 15: *map = xmgen_rings(MAP_WIDTH, MAP_HEIGHT, 100, 30, 8); break;
-        case 16: *map = xmgen_prefab_rooms(MAP_WIDTH, MAP_HEIGHT, 50, 3); break;
-        default: break;
+        Mesh mesh = { 0 };
+        MeshKind(&mesh, kinds, done, w, h, k);
+        if (!mesh.vertexCount) continue;
+        mesh.vertices = (float *)MemAlloc(mesh.vertexCount * 3 * sizeof(float));
+        mesh.normals = (float *)MemAlloc(mesh.vertexCount * 3 * sizeof(float));
+        mesh.vertexCount = mesh.triangleCount = 0;
+        MeshKind(&mesh, kinds, done, w, h, k);
+        out.meshes[k] = mesh;
     }
-    xmgen_add_enviroment(map, '"', 0, 0, MAP_WIDTH, MAP_HEIGHT, 0.55);
-    for (int i = 0; i < rand()%4; i++)
-        xmgen_add_lake(map, '?', rand()%(MAP_HEIGHT - 30), rand()%(MAP_WIDTH - 30), 30, 30, 0.45);
-    xmgen_add_lake(map, '|', rand()%(MAP_HEIGHT - 20), rand()%(MAP_WIDTH - 20), 20, 20, 0.45);
-}
-
-const char *generatorNames[] = {
-    "Cellular Generator",
-    "Delaunay Graph Generator",
-    "Graph Generator",
-    "Brogue Generator",
-    "Room Maze Generator",
-    "Drunk Generator",
-    "Subtractive Generator",
-    "Perlin Generator",
-    "Maze Generator",
-    "BSP Generator",
-    "Dummy Generator",
-    "Zorbus-like Generator",
-    "Hub Generator",
-    "Winding Drunk Generator",
-    "Cross Sections Generator",
-    "Ring Generator",
-    "Prefab Generator"
-};
-
-int main(void)
+    MemFree(done);
+    MemFree(kinds);
+    return out;
+}
+
+// Uploads the meshes, each coloured through its material. The models own them.
+static MapModels UploadMapModels(MapMeshes *meshes)
+{
+    MapModels out = { 0 };
+    for (int k = 0; k < TILE_KINDS; k++)
+    {
+        if (!meshes->meshes[k].vertexCount) continue;
+        UploadMesh(&meshes->meshes[k], false);
+        out.models[k] = LoadModelFromMesh(meshes->meshes[k]);
+        out.models[k].materials[0].maps[MATERIAL_MAP_DIFFUSE].color = TileColor(k);
+        out.loaded[k] = true;
+    }
+    return out;
+}
+
+static MapModels BuildMapModels(Map map)
+{
+    MapMeshes meshes = BuildMapMeshes(map);
+    return UploadMapModels(&meshes);
+}
+
+static void UnloadMapModels(MapModels *models)
+{
+    for (int k = 0; k < TILE_KINDS; k++)
+        if (models->loaded[k]) UnloadModel(models->models[k]);
+    *models = (MapModels){ 0 };
+}
+
+// The minimap lives in a texture with one pixel per scale x scale tiles
+// (their average colour), scale being the smallest power of two that fits
+// MINIMAP_PIXELS, so drawing it is one quad. Edits mark dirty tile
+// rectangles and MinimapUpdate re-shades and uploads only those rows.
+#define MINIMAP_PIXELS 256
+#define MINIMAP_DIRTY 16
+
+typedef struct
+{
+    Image image;
+    Texture2D texture;
+    int scale;
+    int dirty[MINIMAP_DIRTY][4];  // x0, y0, x1, y1 in pixels, exclusive
+    int dirtyCount;
+}
+Minimap;
+
+static void MinimapShade(Minimap *mm, Map map, int x0, int y0, int x1, int y1)
+{
+    Color *pixels = (Color *)mm->image.data;
+    const int s = mm->scale;
+    for (int py = y0; py < y1; py++)
+    {
+        for (int px = x0; px < x1; px++)
+        {
+            int r = 0, g = 0, b = 0, n = 0;
+            for (int y = py * s; y < (py + 1) * s && y < map.h; y++)
+            {
+                for (int x = px * s; x < (px + 1) * s && x < map.w; x++)
+                {
+                    const Color c = TileColor(TileKind(map.walling[y][x]));
+                    r += c.r; g += c.g; b += c.b; n++;
+                }
+            }
+            pixels[py * mm->image.width + px] = (Color){ r / n, g / n, b / n, 255 };
+        }
+    }
+}
+
+// Shades the image only; UploadMinimap makes the texture on the GL thread.
+static Minimap ShadeMinimap(Map map)
+{
+    Minimap mm = { 0 };
+    mm.scale = 1;
+    while ((map.w + mm.scale - 1) / mm.scale > MINIMAP_PIXELS || (map.h + mm.scale - 1) / mm.scale > MINIMAP_PIXELS)
+        mm.scale *= 2;
+    mm.image = GenImageColor((map.w + mm.scale - 1) / mm.scale, (map.h + mm.scale - 1) / mm.scale, BLACK);
+    MinimapShade(&mm, map, 0, 0, mm.image.width, mm.image.height);
+    return mm;
+}
+
+static void UploadMinimap(Minimap *mm)
+{
+    mm->texture = LoadTextureFromImage(mm->image);
+}
+
+static Minimap LoadMinimap(Map map)
+{
+    Minimap mm = ShadeMinimap(map);
+    UploadMinimap(&mm);
+    return mm;
+}
+
+static void UnloadMinimap(Minimap *mm)
+{
+    UnloadTexture(mm->texture);
+    UnloadImage(mm->image);
+    *mm = (Minimap){ 0 };
+}
+
+// Marks tiles x .. x + w - 1, y .. y + h - 1 as changed. A full list
+// collapses into its bounding box.
+static void MinimapMark(Minimap *mm, int x, int y, int w, int h)
+{
+    int r[4] = { x / mm->scale, y / mm->scale, (x + w + mm->scale - 1) / mm->scale, (y + h + mm->scale - 1) / mm->scale };
+    if (r[0] < 0) r[0] = 0;
+    if (r[1] < 0) r[1] = 0;
+    if (r[2] > mm->image.width) r[2] = mm->image.width;
+    if (r[3] > mm->image.height) r[3] = mm->image.height;
+    if (r[0] >= r[2] || r[1] >= r[3]) return;
+    if (mm->dirtyCount == MINIMAP_DIRTY)
+    {
+        for (int i = 1; i < mm->dirtyCount; i++)
+        {
+            int *d = mm->dirty[i];
+            if (d[0] < mm->dirty[0][0]) mm->dirty[0][0] = d[0];
+            if (d[1] < mm->dirty[0][1]) mm->dirty[0][1] = d[1];
+            if (d[2] > mm->dirty[0][2]) mm->dirty[0][2] = d[2];
+            if (d[3] > mm->dirty[0][3]) mm->dirty[0][3] = d[3];
+        }
+        mm->dirtyCount = 1;
+    }
+    memcpy(mm->dirty[mm->dirtyCount++], r, sizeof(r));
+}
+
+static void MinimapUpdate(Minimap *mm, Map map)
+{
+    const Color *pixels = (const Color *)mm->image.data;
+    for (int i = 0; i < mm->dirtyCount; i++)
+    {
+        const int *d = mm->dirty[i];
+        MinimapShade(mm, map, d[0], d[1], d[2], d[3]);
+        // Whole rows are contiguous in the image, so they upload without a copy.
+        UpdateTextureRec(mm->texture, (Rectangle){ 0, (float)d[1], (float)mm->image.width, (float)(d[3] - d[1]) },
+                         pixels + d[1] * mm->image.width);
+    }
+    mm->dirtyCount = 0;
+}
+
+static void DrawMinimap(const Minimap *mm, int posX, int posY, int width, int height)
+{
+    DrawTexturePro(mm->texture, (Rectangle){ 0, 0, (float)mm->image.width, (float)mm->image.height },
+                   (Rectangle){ (float)posX, (float)posY, (float)width, (float)height }, (Vector2){ 0 }, 0.0f, WHITE);
+}
+
+static void DecorateDungeon(Map *map)
+{
+    xmgen_add_enviroment(map, '"', 0, 0, map->w, map->h, 0.55);
+    for (int i = 0; i < mrand()%4; i++)
+        xmgen_add_lake(map, '?', mrand()%(map->h - 30), mrand()%(map->w - 30), 30, 30, 0.45);
+    xmgen_add_lake(map, '|', mrand()%(map->h - 20), mrand()%(map->w - 20), 20, 20, 0.45);
+}
+
+static Map MakeDungeon(int what)
+{
+    Map map = xmgenerate(&xmgenerators[what], mapWidth, mapHeight, NULL);
+    DecorateDungeon(&map);
+    return map;
+}
+
+#ifdef MAP_THREADS
+// R pops a ready map from the pool, two per generator built ahead.
+// On a miss the worker builds it while the current map stays on screen.
+static MapPool pool;
+static MapWorker worker;
+static int nextGenerator;
+
+// Everything the worker prepares for a map but the GL uploads.
+typedef struct
+{
+    MapMeshes meshes;
+    Minimap minimap;
+}
+DungeonBuild;
+
+static void *FinishDungeon(Map *map, void *user)
+{
+    (void)user;
+    DecorateDungeon(map);
+    DungeonBuild *build = (DungeonBuild *)MemAlloc(sizeof(DungeonBuild));
+    build->meshes = BuildMapMeshes(*map);
+    build->minimap = ShadeMinimap(*map);
+    return build;
+}
+
+// Frees a build that was never swapped in.
+static void DropDungeon(void *extra)
+{
+    DungeonBuild *build = (DungeonBuild *)extra;
+    for (int k = 0; k < TILE_KINDS; k++)
+    {
+        MemFree(build->meshes.meshes[k].vertices);
+        MemFree(build->meshes.meshes[k].normals);
+    }
+    UnloadImage(build->minimap.image);
+    MemFree(build);
+}
+
+// Bytes a build holds, so the pool's cap covers meshes and minimap too.
+static size_t MeasureDungeon(const void *extra)
+{
+    const DungeonBuild *build = (const DungeonBuild *)extra;
+    size_t bytes = sizeof(DungeonBuild) + (size_t)build->minimap.image.width * build->minimap.image.height * sizeof(Color);
+    for (int k = 0; k < TILE_KINDS; k++)
+        bytes += (size_t)build->meshes.meshes[k].vertexCount * 6 * sizeof(float);
+    return bytes;
+}
+
+static void SwapDungeon(Map *map, MapModels *models, Minimap *minimap, Map next, DungeonBuild *build)
+{
+    xmclose(*map);
+    *map = next;
+    UnloadMapModels(models);
+    *models = UploadMapModels(&build->meshes);
+    UnloadMinimap(minimap);
+    *minimap = build->minimap;
+    UploadMinimap(minimap);
+    MemFree(build);
+}
+#endif
+
+// Replaces the map with one from a random generator. With threads a miss
+// in the pool leaves the map as it is until the worker's result arrives.
+static void RegenerateDungeon(Map *map, MapModels *models, Minimap *minimap, int *what)
+{
+    const int next = rand() % xmgenerator_count;
+#ifdef MAP_THREADS
+    Map ready;
+    void *extra;
+    if (xmworker_busy(&worker)) return;
+    if (xmpool_try(&pool, next, &ready, &extra))
+    {
+        SwapDungeon(map, models, minimap, ready, (DungeonBuild *)extra);
+        *what = next;
+    }
+    else if (xmworker_request(&worker, &xmgenerators[next], mapWidth, mapHeight, NULL, (unsigned)rand()))
+        nextGenerator = next;
+#else
+    xmclose(*map);
+    *map = MakeDungeon(next);
+    *what = next;
+    UnloadMapModels(models);
+    *models = BuildMapModels(*map);
+    UnloadMinimap(minimap);
+    *minimap = LoadMinimap(*map);
+#endif
+}
+
+// ./main [GENERATOR [WxH]], e.g. ./main cellular 512x512
+int main(int argc, char **argv)
 {
     const int screenWidth = 1200;
     const int screenHeight = 800;
 
+    int currentGenerator = 3;  // start with brogue
+    if (argc > 1 && xmgenerator_find(argv[1])) currentGenerator = (int)(xmgenerator_find(argv[1]) - xmgenerators);
+    if (argc > 2 && sscanf(argv[2], "%dx%d", &mapWidth, &mapHeight) != 2) return 1;
+    if (mapWidth < 40) mapWidth = 40;
+    if (mapHeight < 40) mapHeight = 40;
+
     srand(time(0));
     #ifndef __EMSCRIPTEN__
       //SetConfigFlags(FLAG_FULLSCREEN_MODE); 
@@ -95,15 +456,23 @@ int main(void)
     #endif 
     InitWindow(screenWidth, screenHeight, "raylib [models] - procedural cubicmap");
 
-    int currentGenerator = 3;  // start with brogue
-    Map map = xmgen_brogue(MAP_WIDTH, MAP_HEIGHT, MAX_ROOMS, MIN_ROOM_SIZE, MAX_ROOM_SIZE);
-    xmgen_add_enviroment(&map, '"', 0, 0, MAP_WIDTH, MAP_HEIGHT, 0.55);
-    for (int i = 0; i < rand()%4; i++)
-        xmgen_add_lake(&map, '?', rand()%(MAP_HEIGHT - 30), rand()%(MAP_WIDTH - 30), 30, 30, 0.45);
-    xmgen_add_lake(&map, '|', rand()%(MAP_HEIGHT - 20), rand()%(MAP_WIDTH - 20), 20, 20, 0.45);
+    Map map = MakeDungeon(currentGenerator);
+    MapModels models = BuildMapModels(map);
+    Minimap minimap = LoadMinimap(map);
+#ifdef MAP_THREADS
+    xmpool_init(&pool, 2, (size_t)256 << 20, (unsigned)rand(), FinishDungeon, NULL);
+    pool.drop = DropDungeon;
+    pool.measure = MeasureDungeon;
+    for (int g = 0; g < xmgenerator_count; g++) xmpool_add(&pool, &xmgenerators[g], mapWidth, mapHeight, NULL);
+    xmpool_start(&pool, 2);
+    xmworker_start(&worker, FinishDungeon, NULL);
+    worker.drop = DropDungeon;
+    nextGenerator = currentGenerator;
+#endif
     Camera camera = { 0 };
-    camera.position = (Vector3){ 60.0f, 40.0f, 80.0f };   // elevated to see whole map
-    camera.target = (Vector3){ MAP_WIDTH/2.0f, 0.0f, MAP_HEIGHT/2.0f };
+    const float span = (float)(mapWidth > mapHeight ? mapWidth : mapHeight);
+    camera.position = (Vector3){ mapWidth*0.75f, span*0.4f, mapHeight*0.8f };   // elevated to see whole map
+    camera.target = (Vector3){ mapWidth/2.0f, 0.0f, mapHeight/2.0f };
     camera.up = (Vector3){ 0.0f, 1.0f, 0.0f };
     camera.fovy = 120.0f;
     camera.projection = CAMERA_PERSPECTIVE;
@@ -113,11 +482,27 @@ int main(void)
 
     while (!WindowShouldClose())
     {
-        if (IsKeyPressed(KEY_R))
+        if (IsKeyPressed(KEY_R)) RegenerateDungeon(&map, &models, &minimap, &currentGenerator);
+
+#ifdef MAP_THREADS
+        Map next;
+        void *extra;
+        if (xmworker_poll(&worker, &next, &extra))
+        {
+            SwapDungeon(&map, &models, &minimap, next, (DungeonBuild *)extra);
+            currentGenerator = nextGenerator;
+        }
+#endif
+
+        if (IsKeyPressed(KEY_L))
         {
-            xmclose(map);
-            RegenerateDungeon(&map, &currentGenerator);
+            const int x = rand() % (map.w - 20), y = rand() % (map.h - 20);
+            xmgen_add_lake(&map, '?', x, y, 20, 20, 0.45);
+            MinimapMark(&minimap, x, y, 20, 20);
+            UnloadMapModels(&models);
+            models = BuildMapModels(map);
         }
+        MinimapUpdate(&minimap, map);
 
         if (IsKeyPressed(KEY_P)) pause = !pause;
         if (IsKeyPressed(KEY_TAB)) exit(-1);
@@ -126,42 +511,41 @@ int main(void)
         BeginDrawing();
             ClearBackground(BLACK);
             BeginMode3D(camera);
-                for (int y = 0; y < map.h; y++)
-                {
-                    for (int x = 0; x < map.w; x++)
-                    {
-                        char tile = map.walling[y][x];
-                        Color color = BROWN;       // 
-                        Vector3 pos = { (float)x + 0.5f, 0.5f, (float)y + 0.5f };
-                        if (tile == '#') {color = DARKGRAY; pos.y+=2.0;}
-                        else if (tile == '?') color = BLUE;
-                        else if (tile == '*') color = RED;
-                        else if (tile == '|') color = ORANGE;
-                        else if (tile == '"') color = GREEN;
-                        else if (tile == ' ' || tile == '+') color = BROWN;
-                        else continue; 
-                        
-                        DrawCube(pos, 1.0f, 1.0f, 1.0f, color);
-                    }
-                }
+                for (int k = 0; k < TILE_KINDS; k++)
+                    if (models.loaded[k]) DrawModel(models.models[k], (Vector3){ 0 }, 1.0f, WHITE);
             EndMode3D();
 
-            int minimapCell = 5;                         
-            int minimapWidth = map.w * minimapCell;
-            int minimapHeight = map.h * minimapCell;
+            // The longer side is 500 pixels whatever the map size.
+            int minimapWidth = (int)(map.w * 500 / span);
+            int minimapHeight = (int)(map.h * 500 / span);
             int minimapX = screenWidth - minimapWidth - 20;
             int minimapY = 20;
 
-            DrawMinimap(map, minimapX, minimapY, minimapCell);
+            DrawMinimap(&minimap, minimapX, minimapY, minimapWidth, minimapHeight);
             DrawRectangleLines(minimapX, minimapY, minimapWidth, minimapHeight, GREEN);
 
-            DrawText(generatorNames[currentGenerator], 10, 10, 20, DARKGRAY);
-            DrawText("R: new map | P: pause orbit | TAB: exit", 10, 35, 20, DARKGRAY);
+            DrawText(xmgenerators[currentGenerator].title, 10, 10, 20, DARKGRAY);
+#ifdef MAP_THREADS
+            if (xmworker_busy(&worker))
+                DrawText(TextFormat("generating %s...", xmgenerators[nextGenerator].title), 10, 60, 20, DARKGRAY);
+            MapPoolStats stats;
+            xmpool_stats(&pool, &stats);
+            DrawText(TextFormat("pool: %d ready, %ld hits, %ld misses, refill %.0f ms avg %.0f ms max",
+                                stats.ready, stats.hits, stats.misses, stats.refill_ms, stats.refill_max_ms),
+                     10, screenHeight - 30, 20, DARKGRAY);
+#endif
+            DrawText("R: new map | L: add lake | P: pause orbit | TAB: exit", 10, 35, 20, DARKGRAY);
             //DrawFPS(10, 60);
 
         EndDrawing();
     }
 
+#ifdef MAP_THREADS
+    xmpool_stop(&pool);
+    xmworker_stop(&worker);
+#endif
+    UnloadMinimap(&minimap);
+    UnloadMapModels(&models);
     xmclose(map);
     CloseWindow();
     return 0;
@@ -0,0 +1,199 @@
+// Headless batch generator for content pipelines.
+//
+//   make xmgen
+//   ./xmgen NAME [-s WxH] [--seeds FIRST:COUNT] [-j THREADS] [-o FILE] [param=value ...]
+//
+// Maps for seeds FIRST .. FIRST + COUNT - 1 are generated on THREADS
+// workers and written in seed order, so the output does not depend on the
+// thread count. Without -o they go to stdout as text, one blank line
+// apart; -o FILE (or -o - for stdout) writes a binary pack:
+//
+//   "XMPK" u32 version u32 count, then per map u32 seed u32 w u32 h and
+//   w * h tile bytes row by row, all integers little-endian.
+//
+// Maps per second go to stderr at the end.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define MAP_IMPLEMENTATION
+#include "Map.h"
+
+typedef struct
+{
+    const MapGenerator* generator;
+    const float* params;
+    int w;
+    int h;
+    unsigned first;
+    int count;
+    int window;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int next;     // next index a worker claims
+    int written;  // maps the writer has taken so far
+    Map* slots;   // window entries, slot i % window holds map i
+    bool* ready;
+}
+Batch;
+
+static void* worker(void* arg) {
+    Batch* b = (Batch*)arg;
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        while (b->next < b->count && b->next >= b->written + b->window)
+            pthread_cond_wait(&b->changed, &b->lock);
+        const int i = b->next < b->count ? b->next++ : -1;
+        pthread_mutex_unlock(&b->lock);
+        if (i < 0) return NULL;
+
+        xmseed(b->first + i);
+        const Map map = xmgenerate(b->generator, b->w, b->h, b->params);
+
+        pthread_mutex_lock(&b->lock);
+        b->slots[i % b->window] = map;
+        b->ready[i % b->window] = true;
+        pthread_cond_broadcast(&b->changed);
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+static void put32(FILE* out, const uint32_t v) {
+    const unsigned char bytes[4] = { v & 0xFF, v >> 8 & 0xFF, v >> 16 & 0xFF, v >> 24 };
+    fwrite(bytes, 1, 4, out);
+}
+
+static void write_map(FILE* out, const Map map, const unsigned seed, const bool binary) {
+    if (binary) {
+        put32(out, seed);
+        put32(out, map.w);
+        put32(out, map.h);
+        for (int y = 0; y < map.h; y++) fwrite(map.walling[y], 1, map.w, out);
+        return;
+    }
+    for (int y = 0; y < map.h; y++) {
+        fwrite(map.walling[y], 1, map.w, out);
+        fputc('\n', out);
+    }
+    fputc('\n', out);
+}
+
+static double now(void) {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: xmgen NAME [-s WxH] [--seeds FIRST:COUNT] [-j THREADS] [-o FILE] [param=value ...]\n");
+    for (int i = 0; i < xmgenerator_count; i++) {
+        const MapGenerator* g = &xmgenerators[i];
+        fprintf(stderr, "  %-15s %s\n", g->name, g->params);
+    }
+    exit(1);
+}
+
+// Sets the parameter called key (from "key=value") in params.
+static bool set_param(const MapGenerator* g, float* params, const char* arg) {
+    const char* eq = strchr(arg, '=');
+    if (!eq) return false;
+    const size_t len = eq - arg;
+    const char* name = g->params;
+    for (int i = 0; i < MAP_GENERATOR_PARAMS && *name; i++) {
+        const size_t n = strcspn(name, " ");
+        if (n == len && !strncmp(name, arg, len)) {
+            params[i] = (float)atof(eq + 1);
+            return true;
+        }
+        name += n;
+        while (*name == ' ') name++;
+    }
+    return false;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) usage();
+    const MapGenerator* generator = xmgenerator_find(argv[1]);
+    if (!generator) usage();
+
+    float params[MAP_GENERATOR_PARAMS];
+    memcpy(params, generator->defaults, sizeof(params));
+    int w = 80;
+    int h = 100;
+    unsigned first = 1;
+    int count = 1;
+    int threads = 1;
+    const char* path = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (i + 1 < argc && !strcmp(argv[i], "-s")) {
+            if (sscanf(argv[++i], "%dx%d", &w, &h) != 2) usage();
+        }
+        else if (i + 1 < argc && !strcmp(argv[i], "--seeds")) {
+            if (sscanf(argv[++i], "%u:%d", &first, &count) != 2) usage();
+        }
+        else if (i + 1 < argc && !strcmp(argv[i], "-j")) threads = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "-o")) path = argv[++i];
+        else if (!set_param(generator, params, argv[i])) usage();
+    }
+    if (w < 16 || h < 16 || count < 0) usage();
+    if (threads < 1) threads = 1;
+
+    const bool binary = path != NULL;
+    FILE* out = !path || !strcmp(path, "-") ? stdout : fopen(path, "wb");
+    if (!out) {
+        perror(path);
+        return 1;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    if (binary) {
+        fwrite("XMPK", 1, 4, out);
+        put32(out, 1);
+        put32(out, count);
+    }
+
+    Batch b;
+    zero(b);
+    b.generator = generator;
+    b.params = params;
+    b.w = w;
+    b.h = h;
+    b.first = first;
+    b.count = count;
+    b.window = 4 * threads;
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.changed, NULL);
+    b.slots = (Map*)malloc(b.window * sizeof(Map));
+    b.ready = (bool*)calloc(b.window, sizeof(bool));
+    pthread_t* pool = (pthread_t*)malloc(threads * sizeof(pthread_t));
+
+    const double start = now();
+    for (int t = 0; t < threads; t++) pthread_create(&pool[t], NULL, worker, &b);
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&b.lock);
+        while (!b.ready[i % b.window]) pthread_cond_wait(&b.changed, &b.lock);
+        const Map map = b.slots[i % b.window];
+        b.ready[i % b.window] = false;
+        b.written++;
+        pthread_cond_broadcast(&b.changed);
+        pthread_mutex_unlock(&b.lock);
+
+        write_map(out, map, first + i, binary);
+        xmclose(map);
+    }
+    for (int t = 0; t < threads; t++) pthread_join(pool[t], NULL);
+    bool ok = fflush(out) == 0 && !ferror(out);
+    const double seconds = now() - start;
+    if (out != stdout && fclose(out) != 0) ok = false;
+    if (!ok) perror(path ? path : "stdout");
+
+    fprintf(stderr, "%d %s maps of %dx%d in %.3f s on %d threads: %.1f maps/s\n",
+            count, generator->name, w, h, seconds, threads, seconds > 0 ? count / seconds : 0.0);
+    free(pool);
+    free(b.ready);
+    free(b.slots);
+    pthread_cond_destroy(&b.changed);
+    pthread_mutex_destroy(&b.lock);
+    return ok ? 0 : 1;
+}